@@ -9,6 +9,10 @@
 #include "cnn/expr.h"
 
 #include "util.hpp"
+#include "output-layer.hpp"
+#include "language-model.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -36,79 +40,208 @@ unsigned VOCAB_SIZE = 0;
 char DOC_DELIM = '=';
 string SENT_DELIM = "<s>";
 unsigned REPORT_EVERY_I = 50;
+unsigned BATCH_SIZE = 1;
+unsigned NUM_CLASSES = 0;
+unsigned OUTPUT_RANK = 0;
+unsigned NUM_THREADS = 1;
+unsigned ACCUM_STEPS = 1;
+unsigned SHUFFLE_BLOCK = 0;
+unsigned MIN_COUNT = 0;
+unsigned MAX_VOCAB = 0;
 string FPREFIX;
 
 cnn::Dict d;
+FastDict fast_dict; // the binary file of a loaded dict
+WordClasses classes;
 int kSOS, kEOS;
 string MODELPATH("models/");
 string LOGPATH("logs/");
 
+// a batch of sentences, each in a lane of its own
+DocBatch sentence_batch(const vector<const Sent*>& sents){
+  vector<Doc> docs;
+  vector<const Doc*> lanes;
+  for (auto sp : sents) docs.push_back(Doc(sp, sp + 1));
+  for (auto& doc : docs) lanes.push_back(&doc);
+  return make_batch(lanes, kEOS);
+}
+
+// one training step, prepared ahead by the loader
+struct TrainUnit {
+  DocBatch batch; // sentences as lanes
+  unsigned sents; // sentences in batch
+  unsigned words; // tokens in batch
+};
 
 template <class Builder>
 struct RNNLanguageModel {
   LookupParameters* p_c; //word embeddings VxK1
-  Parameters* p_R; //recurrence weights VxK2
+  OutputLayer output; //recurrence weights VxK2
   Parameters* p_bias; //bias Vx1
   Builder builder;
   
-  explicit RNNLanguageModel(Model& model) : builder(LAYERS, INPUT_DIM, 
-						    HIDDEN_DIM, &model) {
-    p_c = model.add_lookup_parameters(VOCAB_SIZE, {INPUT_DIM}); 
-    p_R = model.add_parameters({VOCAB_SIZE, HIDDEN_DIM});
-    p_bias = model.add_parameters({VOCAB_SIZE});
+  explicit RNNLanguageModel(Model& model, const ModelConfig& c) 
+    : builder(c.nlayers, c.inputdim, c.hiddendim, &model) {
+    p_c = model.add_lookup_parameters(c.vocabsize, {c.inputdim}); 
+    output = OutputLayer(model, c.vocabsize, c.hiddendim, c.classes, 
+			 c.rank);
+    p_bias = model.add_parameters({c.vocabsize});
   }
 
-  // return Expression of total loss
-  Expression BuildLMGraph(const vector<int>& sent, ComputationGraph& cg) {
-    const unsigned slen = sent.size() - 1;
+  // return Expression of total loss over a batch of sentences,
+  //   shorter sentences are padded and masked out
+  Expression BuildLMGraph(const DocBatch& batch, 
+			  ComputationGraph& cg) {
     builder.new_graph(cg);  // reset RNN builder for new graph
-    builder.start_new_sequence();
-    Expression i_R = parameter(cg, p_R); // hidden -> word rep parameter
+    output.new_graph(cg); // hidden -> word rep parameter
     Expression i_bias = parameter(cg, p_bias);  // word bias
 
-    vector<Expression> errs;
-    for (unsigned t = 0; t < slen; ++t) {
-      Expression i_x_t = lookup(cg, p_c, sent[t]); 
-      Expression i_y_t = builder.add_input(i_x_t); 
-      Expression i_r_t =  i_bias + i_R * i_y_t;
-
-      Expression i_err = pickneglogsoftmax(i_r_t, sent[t+1]);
-      errs.push_back(i_err);
+    vector<Expression> hs, errs;
+    for (unsigned k = 0; k < batch.inputs.size(); ++k) {
+      builder.start_new_sequence();
+      hs.clear();
+      for (unsigned t = 0; t < batch.inputs[k].size(); ++t) {
+	Expression i_x_t = lookup(cg, p_c, batch.inputs[k][t]); 
+	Expression i_y_t = builder.add_input(i_x_t); 
+	hs.push_back(i_y_t);
+      }
+      errs.push_back(output.neglogprob(hs, i_bias, batch.seq_targets[k], 
+				       batch.seq_masks[k]));
     }
     Expression i_nerr = sum(errs);
     return i_nerr;
   }
 };
 
+// ******************************************************
+// The baseline behind the common interface: sentences 
+//   are scored on their own, a document as a batch of 
+//   its sentences
+// ******************************************************
+class BaselineLM : public LanguageModel {
+  Model model;
+  RNNLanguageModel<LSTMBuilder> lm;
+  DocBatch scored; // kept alive until the graph is evaluated
+
+public:
+  BaselineLM(const ModelConfig& c):lm(model, c){}
+
+  vector<Model*> models(){ return {&model}; }
+
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    lm.output.set_sampler(sampler, nsamples);
+  }
+
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    lm.output.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
+    vector<const Sent*> sents;
+    for (auto& sent : doc) sents.push_back(&sent);
+    scored = sentence_batch(sents);
+    return lm.BuildLMGraph(scored, cg);
+  }
+
+  bool batched() const { return true; }
+  Expression BuildBatchGraph(const DocBatch& batch, ComputationGraph& cg){
+    return lm.BuildLMGraph(batch, cg);
+  }
+};
+
+static bool registered = 
+  register_model("baseline", [](const ModelConfig& c) -> LanguageModel* {
+      return new BaselineLM(c); });
+
+// sort all sentences by length and cut them into batches, so
+//   that sentences in one batch need little padding
+vector<vector<const Sent*>> make_buckets(const Corpus& corpus){
+  vector<const Sent*> sents;
+  for (auto& doc : corpus)
+    for (auto& sent : doc)
+      sents.push_back(&sent);
+  stable_sort(sents.begin(), sents.end(), 
+	      [](const Sent* a, const Sent* b){ 
+		return a->size() < b->size(); });
+  vector<vector<const Sent*>> batches;
+  for (unsigned i = 0; i < sents.size(); i += BATCH_SIZE){
+    unsigned j = min((unsigned)sents.size(), i + BATCH_SIZE);
+    batches.push_back(vector<const Sent*>(sents.begin() + i, 
+					  sents.begin() + j));
+  }
+  return batches;
+}
+
 
 int train(string ftrn, string fdev){
   // -------------------------------------------
   LOG(INFO) << "Training data: " << ftrn;
-  Corpus training = readData((char*) ftrn.c_str(), &d, true);
+  Corpus training = readTrainingData((char*) ftrn.c_str(), &d, 
+				     MIN_COUNT, MAX_VOCAB);
   d.Freeze(); VOCAB_SIZE = d.size();
+  kSOS = d.Convert("<s>"); kEOS = d.Convert("</s>");
+  if (NUM_CLASSES > 0){
+    // frequency-binned classes for a factored softmax
+    classes = build_classes(count_words(training, VOCAB_SIZE), 
+			    NUM_CLASSES);
+    LOG(INFO) << "Number of word classes: " << classes.size();
+  }
   LOG(INFO) << "Dev data: " << fdev;
   Corpus dev = readData((char*) fdev.c_str(), &d, false);
+  // bucket sentences by length
+  LOG(INFO) << "Batch size: " << BATCH_SIZE;
+  vector<vector<const Sent*>> batches = make_buckets(training);
+  vector<vector<const Sent*>> devbatches = make_buckets(dev);
 
   // -------------------------------------------
   string fname = MODELPATH + FPREFIX;
   LOG(INFO) << "Save dict into: " << fname << ".dict";
   LOG(INFO) << "Parameters will be written to: " << fname << ".model";
   save_dict(fname, d);
+  if (classes.size() > 0) save_classes(fname, classes);
+  if (OUTPUT_RANK > 0) save_rank(fname, OUTPUT_RANK);
   // check model path
   check_dir(MODELPATH);
   double best = 9e+99;
 
   // -------------------------------------------
-  Model model;
+  ModelConfig config = {LAYERS, INPUT_DIM, HIDDEN_DIM, 0, 
+			VOCAB_SIZE, &classes, OUTPUT_RANK};
+  unique_ptr<LanguageModel> lm = make_model("baseline", config);
+  Model& model = *lm->models()[0];
   Trainer* sgd = nullptr;
   sgd = new SimpleSGDTrainer(&model);
-  RNNLanguageModel<LSTMBuilder> lm(model);
+  // hogwild workers update the model in shared memory
+  LOG(INFO) << "Training workers: " << NUM_THREADS;
+  if (NUM_THREADS > 1) share_model(model);
+  Hogwild hogwild(NUM_THREADS);
+  // deferred updates on accumulated gradients
+  LOG(INFO) << "Batches per update: " << ACCUM_STEPS;
+  if (ACCUM_STEPS > 1) accumulate_updates(sgd, ACCUM_STEPS);
+  unsigned nsteps = 0;
+  // apply the gradients summed since the last update, 
+  //   if any
+  auto flush = [&](){
+    if (nsteps % ACCUM_STEPS == 0) return;
+    sgd->update(1.0 / ACCUM_STEPS);
+    nsteps += ACCUM_STEPS - nsteps % ACCUM_STEPS;
+  };
 
   unsigned dev_every_i_reports = 20;
-  unsigned si = 0;
-
-  vector<unsigned> order(training.size());
-  for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+  // batches are shuffled and counted on a producer thread
+  auto make = [&](const vector<unsigned>& items){
+    TrainUnit unit;
+    auto& batch = batches[items[0]];
+    unit.batch = sentence_batch(batch);
+    unit.sents = batch.size();
+    unit.words = 0;
+    for (auto sp : batch)
+      unit.words += sp->size();
+    return unit;
+  };
+  Prefetcher<TrainUnit> loader(batches.size(), 1, SHUFFLE_BLOCK, 0, 
+			       nullptr, make, (*rndeng)());
   bool first = true;
   int report = 0;
   unsigned lines = 0;
@@ -118,27 +251,48 @@ int train(string ftrn, string fdev){
     double loss = 0;
     unsigned lines = 0;
     unsigned words = 0;
+    // build graph for this batch of sentences and update
+    auto train_step = [&](const TrainUnit& unit) -> double {
+      ComputationGraph cg;
+      lm->BuildBatchGraph(unit.batch, cg);
+      double dloss = as_scalar(cg.forward());
+      cg.backward();
+      // gradients are summed over ACCUM_STEPS batches
+      if (++nsteps % ACCUM_STEPS == 0)
+	sgd->update(1.0 / ACCUM_STEPS);
+      return dloss;
+    };
+    vector<TrainUnit> steps;
     for (unsigned i = 0; i < REPORT_EVERY_I; ++i) {
-      if (si == training.size()) {
-        si = 0;
+      TrainUnit unit;
+      bool newpass;
+      if (!loader.next(unit, newpass)){
+	LOG(INFO) << "No training sentences";
+	return -1;
+      }
+      if (newpass) {
         if (first) { first = false; } 
 	else { sgd->update_epoch(); }
-        shuffle(order.begin(), order.end(), *rndeng);
       }
-      auto& doc = training[order[si]];
-
-      for (unsigned j = 0; j < doc.size(); j++){
-	// build graph for this instance
-	ComputationGraph cg;
-	auto& sent = doc[j];
-	words += sent.size();
-	lm.BuildLMGraph(sent,cg);
-	loss += as_scalar(cg.forward());
-	cg.backward();
-	sgd->update();
-	++lines;
+      words += unit.words;
+      lines += unit.sents;
+      // run now, or leave it to the workers
+      if (NUM_THREADS > 1) steps.push_back(move(unit));
+      else loss += train_step(unit);
+    }
+    if (NUM_THREADS > 1){
+      // lock-free updates from all workers at once, with
+      //   the producer stopped while they are forked
+      double dloss = 0;
+      auto step = [&](unsigned k){ return train_step(steps[k]); };
+      loader.pause();
+      int ret = hogwild.run(steps.size(), step, dloss, flush);
+      loader.resume();
+      if (ret < 0){
+	LOG(INFO) << "A training worker failed";
+	return -1;
       }
-      ++si;
+      loss += dloss;
     }
     sgd->status();
     LOG(INFO) << " E = " 
@@ -152,13 +306,13 @@ int train(string ftrn, string fdev){
       double dloss = 0;
       int dwords = 0;
       int docctr = 0;
-      for (auto& doc : dev){
-	for (auto& sent : doc){
-	  ComputationGraph cg;
-	  lm.BuildLMGraph(sent, cg);
-	  dloss += as_scalar(cg.forward());
-	  dwords += sent.size() - 1;
-	}
+      for (auto& batch : devbatches){
+	DocBatch lanes = sentence_batch(batch);
+	ComputationGraph cg;
+	lm->BuildBatchGraph(lanes, cg);
+	dloss += as_scalar(cg.forward());
+	for (auto sp : batch)
+	  dwords += sp->size() - 1;
       }
       LOG(INFO) << "DEV [epoch=" 
 		<< (lines / (double)training.size()) 
@@ -172,7 +326,7 @@ int train(string ftrn, string fdev){
       if (dloss < best) {
         best = dloss;
 	LOG(INFO) << "Save model into: "<<fname;
-	save_model(fname, model);
+	lm->save(fname, "baseline");
       }
     }
   }
@@ -183,29 +337,43 @@ int train(string ftrn, string fdev){
 int test(string fprefix, string ftst){
   // -------------------------------------------
   cerr << "Load dict from: " << fprefix << ".dict" << endl;
-  load_dict(fprefix, d);
-  d.Freeze(); VOCAB_SIZE = d.size();
+  load_dict(fprefix, d, &fast_dict);
+  d.Freeze(); 
+  if (fast_dict.is_open()){
+    // words are looked up in the binary dict
+    VOCAB_SIZE = fast_dict.size();
+    kSOS = fast_dict.convert("<s>", 3); kEOS = fast_dict.convert("</s>", 4);
+  } else {
+    VOCAB_SIZE = d.size();
+    kSOS = d.Convert("<s>"); kEOS = d.Convert("</s>");
+  }
+  if (load_classes(fprefix, classes) == 0)
+    cerr << "Number of word classes: " << classes.size() << endl;
+  OUTPUT_RANK = load_rank(fprefix);
   cerr << "Test data: " << ftst;
   // call the readData from util.hpp
-  Corpus tst = readData((char*) ftst.c_str(), &d, false);
+  Corpus tst = readData((char*) ftst.c_str(), &d, false, 
+			fast_dict.is_open() ? &fast_dict : nullptr);
+  vector<vector<const Sent*>> batches = make_buckets(tst);
 
   // -------------------------------------------
-  Model model;
-  RNNLanguageModel<LSTMBuilder> lm(model);
+  ModelConfig config = {LAYERS, INPUT_DIM, HIDDEN_DIM, 0, 
+			VOCAB_SIZE, &classes, OUTPUT_RANK};
+  unique_ptr<LanguageModel> lm = make_model("baseline", config);
   cerr << "Load model from: " << fprefix << endl;
-  load_model(fprefix, model);
+  if (lm->load(fprefix, "baseline") != 0) return -1;
 
   double loss = 0, dloss = 0;
   int dwords = 0, words = 0;
-  for (auto& doc : tst){
-    for (auto& sent : doc){
-      ComputationGraph cg;
-      lm.BuildLMGraph(sent, cg);
-      dwords = sent.size() - 1;
-      dloss = as_scalar(cg.forward());
-      words += dwords;
-      loss += dloss;
-    }
+  for (auto& batch : batches){
+    DocBatch lanes = sentence_batch(batch);
+    ComputationGraph cg;
+    lm->BuildBatchGraph(lanes, cg);
+    dwords = 0;
+    for (auto sp : batch) dwords += sp->size() - 1;
+    dloss = as_scalar(cg.forward());
+    words += dwords;
+    loss += dloss;
   }
   cerr << "PPL = "
        << boost::format("%5.4f") % exp(loss / words) << endl;
@@ -229,7 +397,15 @@ int main(int argc, char** argv) {
     ("layers", po::value<int>()->default_value((int)2), "number of RNN layers")
     ("input-dim", po::value<int>()->default_value((int)16), "input dimension")
     ("hidden-dim", po::value<int>()->default_value((int)48), "hidden dimension")
-    ("report-stride", po::value<int>()->default_value((int)50), "report every i iterations");
+    ("report-stride", po::value<int>()->default_value((int)50), "report every i iterations")
+    ("batch-size", po::value<int>()->default_value((int)1), "number of sentences per minibatch")
+    ("classes", po::value<int>()->default_value((int)0), "number of word classes for a factored softmax, 0 for a full softmax")
+    ("rank", po::value<int>()->default_value((int)0), "rank of a factored output layer, 0 for a full matrix")
+    ("threads", po::value<int>()->default_value((int)1), "number of hogwild training workers")
+    ("accumulate", po::value<int>()->default_value((int)1), "number of batches whose gradients are averaged before each update")
+    ("shuffle-block", po::value<int>()->default_value((int)0), "shuffle blocks of this many neighbouring batches, 0 for a full shuffle")
+    ("min-count", po::value<int>()->default_value((int)0), "words seen fewer times become UNK")
+    ("vocab-size", po::value<int>()->default_value((int)0), "keep only this many most frequent words, 0 for all");
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
   po::notify(vm);    
@@ -249,6 +425,14 @@ int main(int argc, char** argv) {
   INPUT_DIM = vm["input-dim"].as<int>();
   HIDDEN_DIM = vm["hidden-dim"].as<int>();
   REPORT_EVERY_I = vm["report-stride"].as<int>();
+  BATCH_SIZE = max(1, vm["batch-size"].as<int>());
+  NUM_CLASSES = vm["classes"].as<int>();
+  OUTPUT_RANK = vm["rank"].as<int>();
+  NUM_THREADS = max(1, vm["threads"].as<int>());
+  ACCUM_STEPS = max(1, vm["accumulate"].as<int>());
+  SHUFFLE_BLOCK = max(0, vm["shuffle-block"].as<int>());
+  MIN_COUNT = max(0, vm["min-count"].as<int>());
+  MAX_VOCAB = max(0, vm["vocab-size"].as<int>());
   cerr << LAYERS << " " << INPUT_DIM << " " 
        << HIDDEN_DIM << " " << REPORT_EVERY_I;
   // -------------------------------------------------
@@ -8,8 +8,12 @@
 #include "cnn/dict.h"
 
 #include "util.hpp"
+#include "language-model.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
 
 #include <iostream>
+#include <sys/stat.h>
 #include <fstream>
 #include <sstream>
 #include <tuple>
@@ -33,8 +37,27 @@ unsigned INPUTDIM = 96;
 unsigned HIDDENDIM = 96;
 unsigned ALIGNDIM = 48;
 unsigned VOCAB_SIZE = 0;
+unsigned NUM_CLASSES = 0;
+unsigned NUM_SAMPLES = 0;
+float SELF_NORM = 0.0;
+unsigned OUTPUT_RANK = 0;
+unsigned NUM_THREADS = 1;
+unsigned NUM_PROCS = 1;
+unsigned ACCUM_STEPS = 1;
+unsigned SHUFFLE_BLOCK = 0;
+unsigned MIN_COUNT = 0;
+unsigned MAX_VOCAB = 0;
+unsigned TOKEN_BUDGET = 0;
+bool CARRY_CONTEXT = false;
+bool STREAM = false;
+unsigned RESERVOIR = 0;
+string DICT_PREFIX;
+Precision MODEL_PRECISION = FP32; // of saved models
+bool EXACT_SCORING = false;
 
 cnn::Dict d;
+FastDict fast_dict; // the binary file of a loaded dict
+WordClasses classes;
 int kEOS, kSOS;
 
 string MODELPATH("models/");
@@ -44,11 +67,70 @@ typedef Sent Sentence;
 typedef Doc Document;
 // typedef vector<Document> Corpus;
 
+// one training step, prepared ahead by the loader
+struct TrainUnit {
+  Document doc; // this process's document
+  Corpus streamed; // keeps a streamed document alive
+  unsigned chars; // words to predict in doc
+  vector<Doc> pieces; // segments, for a carried context
+};
+
+// ******************************************************
+// The document attentional model behind the common 
+//   interface. The context it carries, the sentence 
+//   representations of the previous segments, goes 
+//   around as one flat vector.
+// ******************************************************
+class AttentionalLM : public LanguageModel {
+  Model model;
+  DocumentAttentionalModel<LSTMBuilder> lm;
+  vector<vector<float>> memory; // inputs of the last graph
+
+public:
+  AttentionalLM(const ModelConfig& c)
+    :lm(model, c.vocabsize, c.nlayers, c.inputdim, c.hiddendim, 
+	c.aligndim, c.classes, c.rank){}
+
+  vector<Model*> models(){ return {&model}; }
+
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    lm.output.set_sampler(sampler, nsamples);
+  }
+
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    lm.output.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
+    memory.clear();
+    if (context == nullptr) return lm.BuildGraph(doc, cg);
+    unsigned n = lm.context_dim;
+    for (unsigned i = 0; i + n <= context->size(); i += n)
+      memory.push_back(vector<float>(context->begin() + i, 
+				     context->begin() + i + n));
+    return lm.BuildGraph(doc, cg, &memory);
+  }
+
+  bool carries_context() const { return true; }
+  vector<float> final_context(){
+    vector<float> context;
+    for (auto& m : lm.final_context())
+      context.insert(context.end(), m.begin(), m.end());
+    return context;
+  }
+};
+
+static bool registered = 
+  register_model("dam", [](const ModelConfig& c) -> LanguageModel* {
+      return new AttentionalLM(c); });
+
 #define WTF(expression) \
     std::cout << #expression << " has dimensions " << cg.nodes[expression.i]->dim << std::endl;
 
 void read_documents(char* fname, Corpus &corpus, bool b_update) {
-  corpus = readData(fname, &d, b_update);
+  corpus = readData(fname, &d, b_update, 
+		    fast_dict.is_open() ? &fast_dict : nullptr);
 }
 
 int train(char* ftrn, char* fdev, string fname){
@@ -60,61 +142,282 @@ int train(char* ftrn, char* fdev, string fname){
   // --------------------------------------------
   // load the corpora
   Corpus training, dev;
-  LOG(INFO) << "Reading training data from: " << ftrn;
-  read_documents(ftrn, training, true);
+  if (STREAM){
+    // online training reads against a frozen dict
+    if (DICT_PREFIX.size() == 0){
+      LOG(INFO) << "Online training needs a dict prefix";
+      return -1;
+    }
+    LOG(INFO) << "Load dict from: " << DICT_PREFIX;
+    load_dict(DICT_PREFIX, d, &fast_dict);
+    // the dict is saved with the model
+    if (fast_dict.is_open()) fast_dict.fill(d);
+  } else {
+    LOG(INFO) << "Reading training data from: " << ftrn;
+    // rare words become UNK
+    training = readTrainingData(ftrn, &d, MIN_COUNT, MAX_VOCAB);
+  }
   int len_thresh = 5;
-  LOG(INFO) << "Length threshold: " << len_thresh;
-  training = segment_doc(training, len_thresh);
-  LOG(INFO) << "New training set size: " << training.size();
+  Corpus segments;
+  if (TOKEN_BUDGET > 0){
+    LOG(INFO) << "Token budget: " << TOKEN_BUDGET;
+    if (!STREAM) segments = pack_doc(training, TOKEN_BUDGET);
+  } else {
+    LOG(INFO) << "Length threshold: " << len_thresh;
+    if (!STREAM) segments = segment_doc(training, len_thresh);
+  }
+  if (!STREAM)
+    LOG(INFO) << "New training set size: " << segments.size();
+  // with a carried context, whole documents are shuffled
+  //   and trained segment by segment
+  if (!CARRY_CONTEXT) training = segments;
+  auto segment = [&](const Doc& doc){
+    if (TOKEN_BUDGET > 0) return pack_doc(doc, TOKEN_BUDGET);
+    return segment_doc(doc, len_thresh);
+  };
   d.Freeze(); VOCAB_SIZE = d.size();
   LOG(INFO) << "Parameters will be written to: " << fname;
   LOG(INFO) << "Save dict into: " << fname;
   save_dict(fname, d);
   LOG(INFO) << "Reading dev data from: " << fdev;
   read_documents(fdev, dev, false);
+  // word counts, from the dev data (plus one) for online
+  //   training
+  vector<unsigned> counts = count_words(STREAM ? dev : training, 
+					VOCAB_SIZE);
+  if (STREAM) for (auto& c : counts) c ++;
+  if (STREAM && (load_classes(DICT_PREFIX, classes) == 0)){
+    LOG(INFO) << "Load word classes from: " << DICT_PREFIX;
+  } else if (NUM_CLASSES > 0){
+    // frequency-binned classes for a factored softmax
+    classes = build_classes(counts, NUM_CLASSES);
+  }
+  if (classes.size() > 0){
+    LOG(INFO) << "Number of word classes: " << classes.size();
+    save_classes(fname, classes);
+  }
+  if ((SELF_NORM > 0) && (classes.size() > 0)){
+    LOG(INFO) << "Self-normalization needs a full softmax";
+    return -1;
+  }
+  if (OUTPUT_RANK > 0){
+    LOG(INFO) << "Rank of the output layer: " << OUTPUT_RANK;
+    save_rank(fname, OUTPUT_RANK);
+  }
 
   // --------------------------------------------
   // define model
-  Model model;
+  ModelConfig config = {LAYERS, INPUTDIM, HIDDENDIM, ALIGNDIM, 
+			VOCAB_SIZE, &classes, OUTPUT_RANK};
+  unique_ptr<LanguageModel> lm = make_model("dam", config);
+  Model& model = *lm->models()[0];
   Trainer* sgd = new SimpleSGDTrainer(&model);
-  DocumentAttentionalModel<LSTMBuilder> lm(model, VOCAB_SIZE, 
-					   LAYERS, INPUTDIM, 
-					   HIDDENDIM, ALIGNDIM);
+  
+  // negatives for sampled softmax training
+  UnigramSampler sampler(counts);
+  const UnigramSampler* psampler = nullptr;
+  if (NUM_SAMPLES > 0){
+    LOG(INFO) << "Sampled softmax with " << NUM_SAMPLES << " negatives";
+    psampler = &sampler;
+  }
+  // self-normalized models can be scored without log Z
+  if (SELF_NORM > 0){
+    LOG(INFO) << "Self-normalization penalty: " << SELF_NORM;
+    ofstream out(fname + ".selfnorm");
+    out << SELF_NORM << endl;
+  }
+  
+  // hogwild workers update the model in shared memory
+  if (NUM_THREADS == 0) NUM_THREADS = 1;
+  if (NUM_PROCS == 0) NUM_PROCS = 1;
+  if ((NUM_THREADS > 1) && (NUM_PROCS > 1)){
+    LOG(INFO) << "Use either hogwild workers or data-parallel processes";
+    return -1;
+  }
+  // segment counts differ between documents, so the
+  //   processes would fall out of step
+  if (CARRY_CONTEXT && (NUM_PROCS > 1)){
+    LOG(INFO) << "Carried context needs a single process";
+    return -1;
+  }
+  if (CARRY_CONTEXT) LOG(INFO) << "Carry the context across segments";
+  // every data-parallel process reads the stream on its 
+  //   own, which only works for a regular file
+  struct stat st;
+  if (STREAM && (NUM_PROCS > 1) && 
+      ((stat(ftrn, &st) != 0) || !S_ISREG(st.st_mode))){
+    LOG(INFO) << "Data-parallel online training needs a regular file";
+    return -1;
+  }
+  LOG(INFO) << "Training workers: " << NUM_THREADS;
+  if (NUM_THREADS > 1) share_model(model);
+  Hogwild hogwild(NUM_THREADS);
+  // data-parallel processes keep their own copies of the
+  //   model, and all of them shuffle the same way
+  LOG(INFO) << "Data-parallel processes: " << NUM_PROCS;
+  DataParallel replicas(NUM_PROCS, {&model});
+  unsigned seed = (*rndeng)();
+  unsigned proc = replicas.start();
+  // deferred updates on accumulated gradients
+  if (ACCUM_STEPS == 0) ACCUM_STEPS = 1;
+  LOG(INFO) << "Documents per update: " << ACCUM_STEPS;
+  if (ACCUM_STEPS > 1) accumulate_updates(sgd, ACCUM_STEPS);
+  unsigned nsteps = 0;
+  // apply the gradients summed since the last update, 
+  //   if any
+  auto flush = [&](){
+    if (nsteps % ACCUM_STEPS == 0) return;
+    replicas.sum_gradients(model);
+    sgd->update(1.0 / ACCUM_STEPS);
+    nsteps += ACCUM_STEPS - nsteps % ACCUM_STEPS;
+  };
   
   // --------------------------------------------
   unsigned report_every_i = 50;
   unsigned dev_every_i_reports = 20;
-  unsigned si = 0;
-  vector<unsigned> order(training.size());
-  for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
-  bool first = true;
+  // documents are shuffled, cut and counted on a 
+  //   producer thread, one document for each process
+  auto finish = [&](TrainUnit& unit){
+    unit.chars = 0;
+    for (auto &sent: unit.doc)
+      unit.chars += sent.size() - 1;
+    if (CARRY_CONTEXT) unit.pieces = segment(unit.doc);
+  };
+  auto make = [&](const vector<unsigned>& items){
+    TrainUnit unit;
+    unit.doc = training[items[proc]];
+    finish(unit);
+    return unit;
+  };
+  // online training: documents are read while training,
+  //   and cut into segments as they come
+  unique_ptr<DocStream> stream;
+  unique_ptr<Reservoir> reservoir;
+  deque<pair<Corpus, Doc>> pending;
+  auto source = [&](TrainUnit& unit){
+    for (unsigned r = 0; r < NUM_PROCS; ++r){
+      if (pending.empty()){
+	Corpus doc;
+	if (!reservoir->next(doc)) return false;
+	if (CARRY_CONTEXT) pending.push_back(make_pair(doc, doc[0]));
+	else for (auto& piece : segment(doc[0]))
+	       pending.push_back(make_pair(doc, piece));
+      }
+      if (r == proc){
+	unit.streamed = pending.front().first;
+	unit.doc = pending.front().second;
+      }
+      pending.pop_front();
+    }
+    finish(unit);
+    return true;
+  };
+  unique_ptr<Prefetcher<TrainUnit>> loader;
+  if (STREAM){
+    LOG(INFO) << "Online training, shuffle buffer of " << RESERVOIR 
+	      << " documents";
+    stream.reset(new DocStream(ftrn, &d, fast_dict.is_open() ? 
+			       &fast_dict : nullptr));
+    if (!stream->good()){
+      LOG(INFO) << "Cannot read " << ftrn;
+      return -1;
+    }
+    reservoir.reset(new Reservoir(*stream, RESERVOIR, seed));
+    loader.reset(new Prefetcher<TrainUnit>(source));
+  } else {
+    loader.reset(new Prefetcher<TrainUnit>(training.size(), NUM_PROCS, 
+					   SHUFFLE_BLOCK, 0, nullptr, 
+					   make, seed));
+  }
+  bool first = true, done = false;
   int report = 0;
   unsigned lines = 0;
   while(true) {
     Timer iteration("completed in");
     double loss = 0;
     unsigned chars = 0;
+    // train with sampled softmax, if asked for
+    lm->set_sampler(psampler, NUM_SAMPLES);
+    lm->set_selfnorm(SELF_NORM, false);
+    // one update on a document, return the loss; memory, 
+    //   if given, is replaced by the one after the document
+    auto train_doc = [&](const Document& doc, 
+			 vector<float>* memory) -> double {
+      ComputationGraph cg;
+      lm->BuildGraph(doc, cg, memory);
+      double dloss = as_scalar(cg.forward());
+      cg.backward();
+      if (memory) *memory = lm->final_context();
+      // gradients are summed over ACCUM_STEPS documents,
+      //   and over all processes
+      if (++nsteps % ACCUM_STEPS == 0){
+	replicas.sum_gradients(model);
+	sgd->update(1.0 / ACCUM_STEPS);
+      }
+      return dloss;
+    };
+    auto train_step = [&](const TrainUnit& unit) -> double {
+      if (!CARRY_CONTEXT) return train_doc(unit.doc, nullptr);
+      // truncated BPTT: one update per segment, the 
+      //   sentence representations go into the next 
+      //   segment's attention memory as constants
+      vector<float> memory;
+      double dloss = 0;
+      for (auto& piece : unit.pieces)
+	dloss += train_doc(piece, &memory);
+      return dloss;
+    };
+    vector<TrainUnit> steps;
     for (unsigned i = 0; i < report_every_i; ++i) {
-      if (si == training.size()) {
-	si = 0;
+      TrainUnit unit;
+      bool newpass;
+      if (!loader->next(unit, newpass)){
+	if (!STREAM){
+	  LOG(INFO) << "No training documents";
+	  return -1;
+	}
+	done = true;
+	break;
+      }
+      if (newpass) {
 	if (first) { first = false; } 
 	else { sgd->update_epoch(); }
-	LOG(INFO) << "*** SHUFFLE ***" << endl;
-	shuffle(order.begin(), order.end(), *rndeng);
+	if (proc == 0) LOG(INFO) << "*** SHUFFLE ***" << endl;
       }
+      lines += NUM_PROCS;
       
       // build graph for this instance
-      ComputationGraph cg;
-      auto& doc = training[order[si]];
-      for (auto &sent: doc)
-	chars += sent.size() - 1;
-      ++si;
+      chars += unit.chars;
       //cerr << "sent length " << sent.size();
-      lm.BuildGraph(doc, cg);
-      loss += as_scalar(cg.forward());
-      cg.backward();
-      sgd->update();
-      ++lines;
+      // run now, or leave it to the workers
+      if (NUM_THREADS > 1) steps.push_back(move(unit));
+      else loss += train_step(unit);
+    }
+    if (NUM_THREADS > 1){
+      // lock-free updates from all workers at once, with
+      //   the producer stopped while they are forked
+      double dloss = 0;
+      auto step = [&](unsigned k){ return train_step(steps[k]); };
+      loader->pause();
+      int ret = hogwild.run(steps.size(), step, dloss, flush);
+      loader->resume();
+      if (ret < 0){
+	LOG(INFO) << "A training worker failed";
+	return -1;
+      }
+      loss += dloss;
+    }
+    // the last update of the stream may be incomplete
+    if (done) flush();
+    // totals over all processes, only rank 0 reports
+    loss = replicas.sum(loss);
+    chars = replicas.sum(chars);
+    if (done && (proc == 0))
+      LOG(INFO) << "End of the training stream after " 
+		<< stream->count() << " documents";
+    if (proc > 0){
+      if (done) break;
+      continue;
     }
     sgd->status();
     // FIXME: is chars incorrect?
@@ -125,19 +428,26 @@ int train(char* ftrn, char* fdev, string fname){
     
     // show score on dev data?
     report++;
-    if (report % dev_every_i_reports == 0) {
+    if ((report % dev_every_i_reports == 0) || done) {
       double dloss = 0;
       int dchars = 0;
+      // dev perplexity is always exact
+      lm->set_sampler(nullptr, 0);
+      lm->set_selfnorm(0.0, false);
       for (unsigned i = 0; i < dev.size(); ++i) {
 	const auto& doc = dev[i];
 	ComputationGraph cg;
-	lm.BuildGraph(doc, cg);
+	lm->BuildGraph(doc, cg);
 	dloss += as_scalar(cg.forward());
 	for (auto &sent: doc)
 	  dchars += sent.size() - 1;
       }
-      LOG(INFO) << "DEV [epoch = " 
-		<< (lines / (double)training.size()) 
+      // a stream has no epochs, only the documents read
+      //   so far
+      ostringstream pos;
+      if (STREAM) pos << "docs = " << stream->count();
+      else pos << "epoch = " << (lines / (double)training.size());
+      LOG(INFO) << "DEV [" << pos.str() 
 		<< "] E = " 
 		<< boost::format("%1.4f") % (dloss / dchars) 
 		<< " PPL = " 
@@ -148,9 +458,10 @@ int train(char* ftrn, char* fdev, string fname){
       if (dloss < best) {
 	best = dloss;
 	LOG(INFO) << "Save model into: " << fname;
-	save_model(fname, model);
+	lm->save(fname, "dam", MODEL_PRECISION);
       }
     }
+    if (done) break;
   }
   delete sgd;
   return 0;
@@ -160,9 +471,13 @@ int test(char* ftst, string fmodel){
   // -------------------------------------------
   // load dict
   cerr << "Load dict from: " << fmodel << endl;
-  load_dict(fmodel, d);
-  d.Freeze(); VOCAB_SIZE = d.size();
+  load_dict(fmodel, d, &fast_dict);
+  d.Freeze(); 
+  VOCAB_SIZE = fast_dict.is_open() ? fast_dict.size() : d.size();
   cerr << "Vocab size = " << VOCAB_SIZE << endl;
+  if (load_classes(fmodel, classes) == 0)
+    cerr << "Number of word classes: " << classes.size() << endl;
+  OUTPUT_RANK = load_rank(fmodel);
   // -------------------------------------------
   // load data
   cerr << "Read data from: " << ftst << endl;
@@ -171,14 +486,20 @@ int test(char* ftst, string fmodel){
 
   // --------------------------------------------
   // define model
-  Model model;
-  DocumentAttentionalModel<LSTMBuilder> lm(model, VOCAB_SIZE, 
-					   LAYERS, INPUTDIM, 
-					   HIDDENDIM, ALIGNDIM);
+  ModelConfig config = {LAYERS, INPUTDIM, HIDDENDIM, ALIGNDIM, 
+			VOCAB_SIZE, &classes, OUTPUT_RANK};
+  unique_ptr<LanguageModel> lm = make_model("dam", config);
   // --------------------------------------------
   // load model
   cerr << "Load model from: " << fmodel << endl;
-  load_model(fmodel, model);
+  if (lm->load(fmodel, "dam") != 0) return -1;
+  // self-normalized models are scored without log Z, 
+  //   unless asked for exact scores
+  ifstream selfnorm(fmodel + ".selfnorm");
+  if (selfnorm.good() && !EXACT_SCORING){
+    cerr << "Scoring without normalization" << endl;
+    lm->set_selfnorm(0.0, true);
+  }
 
   // --------------------------------------------
   // run test
@@ -190,7 +511,7 @@ int test(char* ftst, string fmodel){
   cerr << "Start computing ..." << endl;
   for (auto& doc : tst){
     ComputationGraph cg;
-    lm.BuildGraph(doc, cg);
+    lm->BuildGraph(doc, cg);
     dloss = as_scalar(cg.forward());
     loss += dloss;
     dwords = 0;
@@ -218,9 +539,9 @@ int main(int argc, char** argv) {
   if (argc < 4) {
     cerr << "Usage: \n" 
 	 <<"\t" << argv[0] 
-	 << " train train_file dev_file [input_dim] [hidden_dim] [align_dim]\n"
+	 << " train train_file dev_file [input_dim] [hidden_dim] [align_dim] [num_classes] [num_samples] [self_norm] [rank] [threads] [procs] [accumulate] [shuffle_block] [min_count] [vocab_size] [token_budget] [carry_context] [stream] [reservoir] [dict_prefix] [fp32|fp16|bf16|int8]\n"
 	 <<"\t" << argv[0] 
-	 << " test model_prefix test_file\n";
+	 << " test model_prefix test_file [exact]\n";
     return 1;
   }
 
@@ -235,6 +556,36 @@ int main(int argc, char** argv) {
     if (argc >= 5) INPUTDIM = atoi(argv[4]);
     if (argc >= 6) HIDDENDIM = atoi(argv[5]);
     if (argc >= 7) ALIGNDIM = atoi(argv[6]);
+    if (argc >= 8) NUM_CLASSES = atoi(argv[7]);
+    if (argc >= 9) NUM_SAMPLES = atoi(argv[8]);
+    if (argc >= 10) SELF_NORM = atof(argv[9]);
+    if (argc >= 11) OUTPUT_RANK = atoi(argv[10]);
+    if (argc >= 12) NUM_THREADS = atoi(argv[11]);
+    if (argc >= 13) NUM_PROCS = atoi(argv[12]);
+    if (argc >= 14) ACCUM_STEPS = atoi(argv[13]);
+    if (argc >= 15) SHUFFLE_BLOCK = atoi(argv[14]);
+    if (argc >= 16) MIN_COUNT = atoi(argv[15]);
+    if (argc >= 17) MAX_VOCAB = atoi(argv[16]);
+    if (argc >= 18) TOKEN_BUDGET = atoi(argv[17]);
+    if (argc >= 19) CARRY_CONTEXT = atoi(argv[18]);
+    if (argc >= 20) STREAM = atoi(argv[19]);
+    if (argc >= 21) RESERVOIR = atoi(argv[20]);
+    if (argc >= 22) DICT_PREFIX = argv[21];
+    // the penalty only applies to a full softmax trained
+    //   exactly
+    if ((SELF_NORM > 0) && ((NUM_CLASSES > 0) || (NUM_SAMPLES > 0))){
+      cerr << "self_norm cannot be used with num_classes or num_samples"
+	   << endl;
+      return -1;
+    }
+    if (argc >= 23){
+      int precision = parse_precision(argv[22]);
+      if (precision < 0){
+	cerr << "Unknown precision " << argv[22] << endl;
+	return -1;
+      }
+      MODEL_PRECISION = (Precision)precision;
+    }
     // --------------------------------------------
     ostringstream os;
     os << "dam" << '_' << LAYERS << '_' << INPUTDIM
@@ -261,6 +612,7 @@ int main(int argc, char** argv) {
   } else if (cmd == "test"){
     char* ftst = argv[3];
     string fmodel = argv[2];
+    if (argc >= 5) EXACT_SCORING = atoi(argv[4]);
     test(ftst, fmodel);
     return -1;
   }
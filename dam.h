@@ -4,6 +4,8 @@
 #include "cnn/cnn.h"
 #include "cnn/expr.h"
 
+#include "output-layer.hpp"
+
 #include <iostream>
 
 namespace cnn {
@@ -17,13 +19,24 @@ struct DocumentAttentionalModel {
 				    unsigned layers, 
 				    unsigned embedding_dim, 
 				    unsigned hidden_dim, 
-				    unsigned align_dim);
+				    unsigned align_dim,
+				    const WordClasses* classes = nullptr,
+				    unsigned rank = 0);
   
-  // forms a computation graph for the 
-  Expression BuildGraph(const std::vector<std::vector<int>> &document, ComputationGraph& cg);
+  // forms a computation graph for the document, memory 
+  //   holds the sentence representations of its previous 
+  //   segments, taken as constants
+  Expression BuildGraph(const Doc& document, ComputationGraph& cg,
+			const std::vector<std::vector<float>>* memory = nullptr);
+
+  // sentence representations at the end of the last 
+  //   BuildGraph, to carry into the next segment (after 
+  //   forward); only the last max_memory of them, so the
+  //   graph of a segment does not grow with the document
+  std::vector<std::vector<float>> final_context();
   
   LookupParameters* p_c;
-  Parameters* p_R;
+  OutputLayer output;
   Parameters* p_Q;
   Parameters* p_P;
   Parameters* p_bias;
@@ -32,6 +45,7 @@ struct DocumentAttentionalModel {
   Parameters* p_va;
   Builder builder;
   unsigned context_dim;
+  unsigned max_memory; // sentences carried into a segment
   
   // statefull functions for incrementally creating computation graph, one
   // target word at a time
@@ -40,7 +54,6 @@ struct DocumentAttentionalModel {
 
   // state variables used in the above two methods
   Expression src;
-  Expression i_R;
   Expression i_Q;
   Expression i_P;
   Expression i_bias;
@@ -51,6 +64,7 @@ struct DocumentAttentionalModel {
   Expression i_empty;
   std::vector<float> zeros;
   std::vector<Expression> context;
+  Expression i_last; // representation of the last sentence
 };
  
 #define WTF(expression)							\
@@ -65,12 +79,14 @@ struct DocumentAttentionalModel {
  template <class Builder>
    DocumentAttentionalModel<Builder>::DocumentAttentionalModel(cnn::Model& model,
 							       unsigned vocab_size, unsigned layers, unsigned embedding_dim, 
-							       unsigned hidden_dim, unsigned align_dim) 
+							       unsigned hidden_dim, unsigned align_dim,
+							       const WordClasses* classes,
+							       unsigned rank) 
    : builder(layers, embedding_dim+layers*hidden_dim, hidden_dim, &model),
-  context_dim(layers*hidden_dim)
+  context_dim(layers*hidden_dim), max_memory(32)
     {
       p_c = model.add_lookup_parameters(vocab_size, {embedding_dim}); 
-      p_R = model.add_parameters({vocab_size, hidden_dim});
+      output = OutputLayer(model, vocab_size, hidden_dim, classes, rank);
       p_P = model.add_parameters({hidden_dim, embedding_dim});
       p_bias = model.add_parameters({vocab_size});
       p_Wa = model.add_parameters({align_dim, layers*hidden_dim});
@@ -121,18 +137,21 @@ struct DocumentAttentionalModel {
      Expression input = concatenate(std::vector<Expression>({i_x_t, i_c_t})); 
      Expression i_y_t = builder.add_input(input);
      Expression i_tildet_t = tanh(affine_transform({i_y_t, i_Q, i_c_t, i_P, i_x_t}));
-     Expression i_r_t = affine_transform({i_bias, i_R, i_tildet_t}); 
      
-     return i_r_t;
+     // the output layer scores it together with the rest 
+     //   of the sentence
+     return i_tildet_t;
    }
  
  template <class Builder>
-   Expression DocumentAttentionalModel<Builder>::BuildGraph(const std::vector<std::vector<int>> &document, ComputationGraph& cg) 
+   Expression DocumentAttentionalModel<Builder>::BuildGraph(const Doc& document, ComputationGraph& cg,
+							    const std::vector<std::vector<float>>* memory) 
    {
      builder.new_graph(cg);
      context.clear();
+     i_last = Expression();
      
-     i_R = parameter(cg, p_R); 
+     output.new_graph(cg);
      i_Q = parameter(cg, p_Q);
      i_P = parameter(cg, p_P);
      i_bias = parameter(cg, p_bias);
@@ -142,23 +161,42 @@ struct DocumentAttentionalModel {
      
      zeros.resize(context_dim, 0);
      i_empty = input(cg, {context_dim}, &zeros);
+     if (memory)
+       for (auto& m : *memory)
+	 context.push_back(input(cg, {context_dim}, &m));
      
-     std::vector<Expression> errs;
+     std::vector<Expression> errs, hs;
+     std::vector<unsigned> targets;
      bool first = true;
      for (const auto &sent: document) {
        start_new_sentence(cg, first);
        const unsigned tlen = sent.size() - 1; 
+       hs.clear(); targets.clear();
        for (unsigned t = 0; t < tlen; ++t) {
-	 Expression i_r_t = add_input(sent[t], t, cg);
-	 Expression i_err = pickneglogsoftmax(i_r_t, sent[t+1]);
-	 errs.push_back(i_err);
+	 hs.push_back(add_input(sent[t], t, cg));
+	 targets.push_back(sent[t+1]);
        }
+       Expression i_err = output.neglogprob(hs, i_bias, targets);
+       errs.push_back(i_err);
        first = false;
      }
+     if (!first) i_last = concatenate(builder.final_h());
      
      Expression i_nerr = sum(errs);
      return i_nerr;
    }
+
+ template <class Builder>
+   std::vector<std::vector<float>> DocumentAttentionalModel<Builder>::final_context()
+   {
+     std::vector<Expression> all(context);
+     if (i_last.pg != nullptr) all.push_back(i_last);
+     unsigned skip = (all.size() > max_memory) ? all.size() - max_memory : 0;
+     std::vector<std::vector<float>> memory;
+     for (unsigned i = skip; i < all.size(); i++)
+       memory.push_back(convertT2V(all[i].value()));
+     return memory;
+   }
  
 #undef WTF
 #undef KTHXBYE
@@ -2,42 +2,61 @@
 #define DCLM_HIDDEN_HPP
 
 #include "util.hpp"
+#include "output-layer.hpp"
 
 template <class Builder>
 class DCLMHidden{
 private:
   LookupParameters* p_c; // word embeddings VxK1
-  Parameters* p_R; // output layer: VxK2
+  OutputLayer output; // output layer: VxK2
   Parameters* p_bias; // bias Vx1
   Parameters* p_context; // default context vector
   Parameters* p_transform; // transformation matrix
   Builder builder;
+  Expression last_cvec; // context vector after BuildGraph
 
 public:
   DCLMHidden();
   DCLMHidden(Model& model, unsigned nlayers, 
 	     unsigned inputdim, unsigned hiddendim, 
-	     unsigned vocabsize):builder(nlayers, 
-					 inputdim+hiddendim, 
-					 hiddendim, &model){
+	     unsigned vocabsize, 
+	     const WordClasses* classes = nullptr,
+	     unsigned rank = 0):builder(nlayers, 
+					inputdim+hiddendim, 
+					hiddendim, &model){
     p_c = model.add_lookup_parameters(vocabsize, {inputdim}); 
     // for hidden output
-    p_R = model.add_parameters({vocabsize, hiddendim});
+    output = OutputLayer(model, vocabsize, hiddendim, classes, rank);
     // for bias
     p_bias = model.add_parameters({vocabsize});
     // for default context vector
     p_context = model.add_parameters({hiddendim});
   } // END of a constructor
   
-  Expression BuildGraph(const Doc doc, ComputationGraph& cg){
+  // train with a sampled softmax, null for exact training
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    output.set_sampler(sampler, nsamples);
+  }
+
+  // self-normalized training and unnormalized scoring
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    output.set_selfnorm(alpha, unnormalized);
+  }
+
+  // context is the final context vector of the previous
+  //   segment of the document, taken as a constant, null
+  //   for the default context vector
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
     // reset RNN builder for new graph
     builder.new_graph(cg);  
+    output.new_graph(cg);
     // define expression
-    Expression i_R = parameter(cg, p_R);
     Expression i_bias = parameter(cg, p_bias);
     Expression i_context = parameter(cg, p_context);
-    Expression cvec, i_x_t, i_h_t, i_y_t, i_err;
-    vector<Expression> vec_exp;
+    Expression cvec, i_x_t, i_h_t, i_err;
+    vector<Expression> vec_exp, hs;
+    vector<unsigned> targets;
     // ------------------------------------------
     // build CG for the doc
     vector<Expression> errs;
@@ -45,10 +64,13 @@ public:
       // start a new sequence for each sentence
       builder.start_new_sequence();
       // for each sentence in this doc
-      auto sent = doc[k];
+      auto& sent = doc[k];
       unsigned slen = sent.size() - 1;
       // get context vector if this is the first sent
       if (k == 0) cvec = i_context;
+      if ((k == 0) && context) 
+	cvec = input(cg, {(unsigned)context->size()}, context);
+      hs.clear(); targets.clear();
       // build RNN for the current sentence
       for (unsigned t = 0; t < slen; t++){
 	// get word representation
@@ -60,30 +82,129 @@ public:
 	i_x_t = concatenate(vec_exp);
 	// compute hidden state
 	i_h_t = builder.add_input(i_x_t);
-	// compute prediction
-	i_y_t = (i_R * i_h_t) + i_bias;
-	// get prediction error
-	i_err = pickneglogsoftmax(i_y_t, sent[t+1]);
-	// add back
-	errs.push_back(i_err);
+	hs.push_back(i_h_t);
+	targets.push_back(sent[t+1]);
       }
+      // get prediction error of the whole sentence
+      i_err = output.neglogprob(hs, i_bias, targets);
+      // add back
+      errs.push_back(i_err);
       // update context vector
       cvec = i_h_t;
     }
+    last_cvec = cvec;
     Expression i_nerr = sum(errs);
     return i_nerr;
   } // END of BuildGraph
 
-  string RandomSample(const Doc cont, ComputationGraph& cg, 
+  // context vector at the end of the last BuildGraph, to
+  //   carry into the next segment (after forward)
+  vector<float> final_context(){
+    return convertT2V(last_cvec.value());
+  }
+
+  Expression BuildBatchGraph(const DocBatch& batch, 
+			     ComputationGraph& cg){
+    // reset RNN builder for new graph
+    builder.new_graph(cg);  
+    output.new_graph(cg);
+    // define expression
+    Expression i_bias = parameter(cg, p_bias);
+    Expression i_context = parameter(cg, p_context);
+    Expression cvec, cnext, i_x_t, i_h_t, i_err;
+    vector<Expression> vec_exp, hs;
+    Dim dlane({1}, batch.nlanes);
+    // every lane starts with the default context vector
+    cvec = i_context * input(cg, dlane, &batch.ones);
+    // ------------------------------------------
+    // build CG for all lanes, one sentence at a time
+    vector<Expression> errs;
+    for (unsigned k = 0; k < batch.inputs.size(); k++){
+      // start a new sequence for each sentence
+      builder.start_new_sequence();
+      // lanes without a k-th sentence keep their context
+      cnext = cvec * input(cg, dlane, &batch.keeps[k]);
+      hs.clear();
+      for (unsigned t = 0; t < batch.inputs[k].size(); t++){
+	// get word representations of all lanes
+	i_x_t = lookup(cg, p_c, batch.inputs[k][t]);
+	vec_exp.clear();
+	// add context vectors
+	vec_exp.push_back(i_x_t); 
+	vec_exp.push_back(cvec);
+	i_x_t = concatenate(vec_exp);
+	// compute hidden states
+	i_h_t = builder.add_input(i_x_t);
+	hs.push_back(i_h_t);
+	// pick up the context of lanes ending here
+	if (batch.ends(k, t))
+	  cnext = cnext + i_h_t * input(cg, dlane, &batch.lasts[k][t]);
+      }
+      // get prediction error, ignore padded lanes
+      i_err = output.neglogprob(hs, i_bias, batch.seq_targets[k], 
+				batch.seq_masks[k]);
+      errs.push_back(i_err);
+      // update context vectors
+      cvec = cnext;
+    }
+    Expression i_nerr = sum(errs);
+    return i_nerr;
+  } // END of BuildBatchGraph
+
+  // ------------------------------------------------
+  // score and sample with an int8 copy of the output 
+  //   layer, false if it has word classes
+  bool quantizable() const { return output.quantizable(); }
+  bool quantize(){
+    return output.quantize();
+  }
+
+  // loss of a doc with the int8 output layer: the graph
+  //   only computes the projected hidden states, which 
+  //   are scored off the graph (forward only)
+  double QuantizedLoss(const Doc& doc, ComputationGraph& cg){
+    builder.new_graph(cg);
+    output.new_graph(cg);
+    Expression i_context = parameter(cg, p_context);
+    Expression cvec, i_x_t, i_h_t;
+    vector<Expression> vec_exp, xs;
+    vector<unsigned> targets;
+    for (unsigned k = 0; k < doc.size(); k++){
+      builder.start_new_sequence();
+      auto& sent = doc[k];
+      unsigned slen = sent.size() - 1;
+      if (k == 0) cvec = i_context;
+      for (unsigned t = 0; t < slen; t++){
+	i_x_t = lookup(cg, p_c, sent[t]);
+	vec_exp.clear();
+	vec_exp.push_back(i_x_t); 
+	vec_exp.push_back(cvec);
+	i_x_t = concatenate(vec_exp);
+	i_h_t = builder.add_input(i_x_t);
+	xs.push_back(output.projection(i_h_t));
+	targets.push_back(sent[t+1]);
+      }
+      cvec = i_h_t;
+    }
+    if (xs.empty()) return 0;
+    cg.incremental_forward();
+    double loss = 0;
+    for (unsigned i = 0; i < xs.size(); i++)
+      loss += output.quantized_neglogprob(as_vector(xs[i].value()),
+					  p_bias->values.v, targets[i]);
+    return loss;
+  }
+
+  string RandomSample(const Doc& cont, ComputationGraph& cg, 
 		      cnn::Dict d, int max_len = 100){
     int kSOS = d.Convert("<s>");
     int kEOS = d.Convert("</s>");
     // define expression
-    Expression i_R = parameter(cg, p_R);
+    output.new_graph(cg);
     Expression i_bias = parameter(cg, p_bias);
     Expression i_context = parameter(cg, p_context);
     // Expression i_transform = parameter(cg, p_transform);
-    Expression cvec, i_x_t, i_h_t, i_y_t, i_err;
+    Expression cvec, i_x_t, i_h_t, i_err;
     vector<Expression> vec_exp;
     // ------------------------------------------
     // build CG for the context
@@ -97,7 +218,7 @@ public:
 	// start a new sequence for each sentence
 	builder.start_new_sequence();
 	// for each sentence in this doc
-	auto sent = cont[k];
+	auto& sent = cont[k];
 	unsigned slen = sent.size() - 1;
 	// get context vector if this is the first sent
 	if (k == 0) cvec = i_context;
@@ -111,8 +232,6 @@ public:
 	  i_x_t = concatenate(vec_exp);
 	  // compute hidden state
 	  i_h_t = builder.add_input(i_x_t);
-	  // compute prediction
-	  i_y_t = (i_R * i_h_t) + i_bias;
 	  // get prediction error
 	  // i_err = pickneglogsoftmax(i_y_t, sent[t+1]);
 	  // add back
@@ -135,12 +254,21 @@ public:
 	vec_exp.push_back(cvec);
 	i_x_t = concatenate(vec_exp);
 	i_h_t = builder.add_input(i_x_t);
-	i_y_t = (i_R * i_h_t) + i_bias;
-	ydist = softmax(i_y_t);
+	vector<float> dist;
+	if (output.quantized()){
+	  // the output layer in int8, off the graph
+	  Expression i_x = output.projection(i_h_t);
+	  cg.incremental_forward();
+	  dist = output.quantized_logprobs(as_vector(i_x.value()),
+					   p_bias->values.v);
+	  for (auto& lp : dist) lp = exp(lp);
+	} else {
+	  ydist = exp(output.logprobs(i_h_t, i_bias));
+	  dist = as_vector(cg.incremental_forward());
+	}
 	// sample from prob
 	unsigned w = 0;
 	while (w == 0 || (int) w == kSOS){
-	  auto dist = as_vector(cg.incremental_forward());
 	  double p = rand01();
 	  // cout << "kEOS = " << dist[kEOS] << endl;
 	  for (; w < dist.size(); w++){
@@ -0,0 +1,190 @@
+#include "language-model.hpp"
+#include "dclm-output.hpp"
+#include "dclm-hidden.hpp"
+#include "rnnlm.hpp"
+#include "hrnnlm.hpp"
+
+// ******************************************************
+// The document-context models: DCLMOutput and DCLMHidden
+//   run minibatches and carry their context vector
+// ******************************************************
+template <class LM>
+class ContextLM : public LanguageModel {
+protected:
+  Model model;
+  LM lm;
+
+public:
+  ContextLM(const ModelConfig& c)
+    :lm(model, c.nlayers, c.inputdim, c.hiddendim, c.vocabsize,
+	c.classes, c.rank){}
+
+  vector<Model*> models(){ return {&model}; }
+
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    lm.set_sampler(sampler, nsamples);
+  }
+
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    lm.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
+    return lm.BuildGraph(doc, cg, context);
+  }
+
+  bool batched() const { return true; }
+  Expression BuildBatchGraph(const DocBatch& batch, ComputationGraph& cg){
+    return lm.BuildBatchGraph(batch, cg);
+  }
+
+  bool carries_context() const { return true; }
+  vector<float> final_context(){ return lm.final_context(); }
+
+  bool quantizable() const { return lm.quantizable(); }
+  bool quantize(){ return lm.quantize(); }
+  double QuantizedLoss(const Doc& doc){
+    ComputationGraph cg;
+    return lm.QuantizedLoss(doc, cg);
+  }
+};
+
+// DCLMHidden also samples continuations
+class HiddenLM : public ContextLM<DCLMHidden<LSTMBuilder>> {
+public:
+  HiddenLM(const ModelConfig& c):ContextLM(c){}
+
+  bool samples() const { return true; }
+  string RandomSample(const Doc& context, ComputationGraph& cg,
+		      cnn::Dict& d){
+    return lm.RandomSample(context, cg, d);
+  }
+};
+
+// ******************************************************
+// The sentence-level RNNLM, without any context
+// ******************************************************
+class SentenceLM : public LanguageModel {
+  Model model;
+  RNNLM<LSTMBuilder> lm;
+
+public:
+  SentenceLM(const ModelConfig& c)
+    :lm(model, c.nlayers, c.inputdim, c.hiddendim, c.vocabsize,
+	c.classes, c.rank){}
+
+  vector<Model*> models(){ return {&model}; }
+
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    lm.set_sampler(sampler, nsamples);
+  }
+
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    lm.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
+    return lm.BuildGraph(doc, cg);
+  }
+
+  bool batched() const { return true; }
+  Expression BuildBatchGraph(const DocBatch& batch, ComputationGraph& cg){
+    return lm.BuildBatchGraph(batch, cg);
+  }
+
+  bool quantizable() const { return lm.quantizable(); }
+  bool quantize(){ return lm.quantize(); }
+  double QuantizedLoss(const Doc& doc){
+    ComputationGraph cg;
+    return lm.QuantizedLoss(doc, cg);
+  }
+};
+
+// ******************************************************
+// The hierarchical RNNLM: a sentence-level and a
+//   word-level model, trained one after the other on
+//   each document and saved into fname.sent.model and
+//   fname.word.model
+// ******************************************************
+class HierarchicalLM : public LanguageModel {
+  Model smodel, wmodel;
+  HRNNLM<LSTMBuilder> lm;
+
+public:
+  HierarchicalLM(const ModelConfig& c)
+    :lm(smodel, wmodel, c.nlayers, c.inputdim, c.hiddendim,
+	c.vocabsize, c.classes, c.rank){}
+
+  vector<Model*> models(){ return {&smodel, &wmodel}; }
+
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    lm.set_sampler(sampler, nsamples);
+  }
+
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    lm.set_selfnorm(alpha, unnormalized);
+  }
+
+  // the loss of the word-level model, on the sentence
+  //   vectors of the sentence-level one
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
+    if (doc.size() > 1){
+      lm.BuildSentGraph(doc, cg);
+      cg.forward();
+    }
+    return lm.BuildWordGraph(doc, cg);
+  }
+
+  // test() has always reported the loss of the 
+  //   sentence-level model
+  Expression BuildTestGraph(const Doc& doc, ComputationGraph& cg){
+    return lm.BuildSentGraph(doc, cg);
+  }
+
+  double TrainGraph(const Doc& doc,
+		    function<void(unsigned, bool)> update){
+    ComputationGraph cg;
+    // nothing to learn for the sentence level from a
+    //   single sentence
+    if (doc.size() > 1){
+      lm.BuildSentGraph(doc, cg);
+      cg.forward();
+      cg.backward();
+    }
+    update(0, doc.size() > 1);
+    // the word level on top of it
+    lm.BuildWordGraph(doc, cg);
+    double loss = as_scalar(cg.forward());
+    cg.backward();
+    update(1, true);
+    return loss;
+  }
+
+  int save(const string& fname, const string& type,
+	   Precision precision = FP32){
+    if (save_model(fname + ".sent", smodel, type, precision) != 0) 
+      return -1;
+    return save_model(fname + ".word", wmodel, type, precision);
+  }
+
+  int load(const string& fname, const string& type){
+    if (load_model(fname + ".sent", smodel, type) != 0) return -1;
+    return load_model(fname + ".word", wmodel, type);
+  }
+};
+
+// ******************************************************
+// the models of main-dclm, by flag
+// ******************************************************
+static bool registered =
+  register_model("output", [](const ModelConfig& c) -> LanguageModel* {
+      return new ContextLM<DCLMOutput<LSTMBuilder>>(c); })
+  && register_model("hidden", [](const ModelConfig& c) -> LanguageModel* {
+      return new HiddenLM(c); })
+  && register_model("rnnlm", [](const ModelConfig& c) -> LanguageModel* {
+      return new SentenceLM(c); })
+  && register_model("hrnnlm", [](const ModelConfig& c) -> LanguageModel* {
+      return new HierarchicalLM(c); });
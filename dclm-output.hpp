@@ -2,26 +2,30 @@
 #define DCLM_OUTPUT_HPP
 
 #include "util.hpp"
+#include "output-layer.hpp"
 
 template <class Builder>
 class DCLMOutput{
 private:
   LookupParameters* p_c; // word embeddings VxK1
-  Parameters* p_R; // output layer: VxK2
+  OutputLayer output; // output layer: VxK2
   Parameters* p_R2; // forward context vector: VxK2
   Parameters* p_bias; // bias Vx1
   Parameters* p_context; // default context vector for sent-level
   Builder builder;
+  Expression last_cvec; // context vector after BuildGraph
 
 public:
   DCLMOutput();
   DCLMOutput(Model& model, unsigned nlayers, 
 	     unsigned inputdim, unsigned hiddendim, 
-	     unsigned vocabsize):builder(nlayers, inputdim, 
-					 hiddendim, &model){
+	     unsigned vocabsize, 
+	     const WordClasses* classes = nullptr,
+	     unsigned rank = 0):builder(nlayers, inputdim, 
+					hiddendim, &model){
     p_c = model.add_lookup_parameters(vocabsize, {inputdim}); 
     // for hidden output
-    p_R = model.add_parameters({vocabsize, hiddendim});
+    output = OutputLayer(model, vocabsize, hiddendim, classes, rank);
     // for forward context vector
     p_R2 = model.add_parameters({vocabsize, hiddendim});
     // for bias
@@ -30,45 +34,186 @@ public:
     p_context = model.add_parameters({hiddendim});
   }
   
-  Expression BuildGraph(const Doc doc, ComputationGraph& cg){
+  // train with a sampled softmax, null for exact training
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    output.set_sampler(sampler, nsamples);
+  }
+
+  // self-normalized training and unnormalized scoring
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    output.set_selfnorm(alpha, unnormalized);
+  }
+
+  // context is the final context vector of the previous
+  //   segment of the document, taken as a constant, null
+  //   for the default context vector
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+			const vector<float>* context = nullptr){
     // reset RNN builder for new graph
     builder.new_graph(cg);  
+    output.new_graph(cg);
     // define expression
-    Expression i_R = parameter(cg, p_R);
     Expression i_R2 = parameter(cg, p_R2);
     Expression i_bias = parameter(cg, p_bias);
     Expression i_context = parameter(cg, p_context);
-    Expression cvec, i_x_t, i_h_t, i_y_t, i_err, ccpb;
+    Expression cvec, i_x_t, i_h_t, i_err, ccpb;
+    vector<Expression> hs;
+    vector<unsigned> targets;
     // -----------------------------------------
     // build CG for the doc
     vector<Expression> errs;
     for (unsigned k = 0; k < doc.size(); k++){
       builder.start_new_sequence();
       // for each sentence in this doc
-      auto sent = doc[k];
+      auto& sent = doc[k];
       unsigned slen = sent.size() - 1;
       // start a new sequence for each sentence
       if (k == 0) cvec = i_context;
+      if ((k == 0) && context) 
+	cvec = input(cg, {(unsigned)context->size()}, context);
       // build RNN for the current sentence
-      ccpb = (i_R2 * cvec) + i_bias;
+      hs.clear(); targets.clear();
       for (unsigned t = 0; t < slen; t++){
 	// get word representation
 	i_x_t = lookup(cg, p_c, sent[t]);
 	// compute hidden state
 	i_h_t = builder.add_input(i_x_t);
-	// compute prediction
-	i_y_t = (i_R * i_h_t) + ccpb;
-	// get prediction error
-	i_err = pickneglogsoftmax(i_y_t, sent[t+1]);
-	// add back
-	errs.push_back(i_err);
+	hs.push_back(i_h_t);
+	targets.push_back(sent[t+1]);
+      }
+      // get prediction error of the whole sentence; 
+      //   scored without normalization, only the context
+      //   terms of the targets are needed, O(K2) per token
+      if (output.scores_targets()){
+	Expression i_bt = (select_rows(i_R2, targets) * cvec)
+	  + select_rows(i_bias, targets);
+	i_err = output.neglogprob_targets(hs, i_bt, targets);
+      } else {
+	ccpb = (i_R2 * cvec) + i_bias;
+	i_err = output.neglogprob(hs, ccpb, targets);
       }
+      // add back
+      errs.push_back(i_err);
       // update context vector
       cvec = i_h_t;
     }
+    last_cvec = cvec;
+    Expression i_nerr = sum(errs);
+    return i_nerr;
+  }
+
+  // context vector at the end of the last BuildGraph, to
+  //   carry into the next segment (after forward)
+  vector<float> final_context(){
+    return convertT2V(last_cvec.value());
+  }
+
+  Expression BuildBatchGraph(const DocBatch& batch, 
+			     ComputationGraph& cg){
+    // reset RNN builder for new graph
+    builder.new_graph(cg);  
+    output.new_graph(cg);
+    // define expression
+    Expression i_R2 = parameter(cg, p_R2);
+    Expression i_bias = parameter(cg, p_bias);
+    Expression i_context = parameter(cg, p_context);
+    Expression cvec, cnext, i_x_t, i_h_t, i_err, ccpb;
+    vector<Expression> hs;
+    Dim dlane({1}, batch.nlanes);
+    // every lane starts with the default context vector
+    cvec = i_context * input(cg, dlane, &batch.ones);
+    // -----------------------------------------
+    // build CG for all lanes, one sentence at a time
+    vector<Expression> errs;
+    for (unsigned k = 0; k < batch.inputs.size(); k++){
+      builder.start_new_sequence();
+      // build RNN for the current sentences; lanes are 
+      //   always normalized, which needs all rows anyway
+      ccpb = affine_transform({i_bias, i_R2, cvec});
+      // lanes without a k-th sentence keep their context
+      cnext = cvec * input(cg, dlane, &batch.keeps[k]);
+      hs.clear();
+      for (unsigned t = 0; t < batch.inputs[k].size(); t++){
+	// get word representations of all lanes
+	i_x_t = lookup(cg, p_c, batch.inputs[k][t]);
+	// compute hidden states
+	i_h_t = builder.add_input(i_x_t);
+	hs.push_back(i_h_t);
+	// pick up the context of lanes ending here
+	if (batch.ends(k, t))
+	  cnext = cnext + i_h_t * input(cg, dlane, &batch.lasts[k][t]);
+      }
+      // get prediction error, ignore padded lanes
+      i_err = output.neglogprob(hs, ccpb, batch.seq_targets[k], 
+				batch.seq_masks[k]);
+      errs.push_back(i_err);
+      // update context vectors
+      cvec = cnext;
+    }
     Expression i_nerr = sum(errs);
     return i_nerr;
   }
+
+  // score with an int8 copy of the output layer, false 
+  //   if it has word classes
+  bool quantizable() const { return output.quantizable(); }
+  bool quantize(){
+    return output.quantize();
+  }
+
+  // loss of a doc with the int8 output layer: the graph
+  //   computes the projected hidden states and the 
+  //   context terms of each sentence (in fp32), which are
+  //   scored off the graph (forward only)
+  double QuantizedLoss(const Doc& doc, ComputationGraph& cg){
+    builder.new_graph(cg);
+    output.new_graph(cg);
+    Expression i_R2 = parameter(cg, p_R2);
+    Expression i_bias = parameter(cg, p_bias);
+    Expression cvec = parameter(cg, p_context);
+    Expression i_x_t, i_h_t;
+    vector<Expression> xs, ccpbs;
+    vector<unsigned> targets, slens;
+    // without normalization only the context terms of the
+    //   targets are needed, as in BuildGraph
+    bool rows = output.scores_targets();
+    for (unsigned k = 0; k < doc.size(); k++){
+      builder.start_new_sequence();
+      auto& sent = doc[k];
+      unsigned slen = sent.size() - 1;
+      vector<unsigned> stargets(sent.begin() + 1, sent.end());
+      if (slen == 0) continue;
+      if (rows)
+	ccpbs.push_back((select_rows(i_R2, stargets) * cvec)
+			+ select_rows(i_bias, stargets));
+      else
+	ccpbs.push_back((i_R2 * cvec) + i_bias);
+      slens.push_back(slen);
+      for (unsigned t = 0; t < slen; t++){
+	i_x_t = lookup(cg, p_c, sent[t]);
+	i_h_t = builder.add_input(i_x_t);
+	xs.push_back(output.projection(i_h_t));
+	targets.push_back(stargets[t]);
+      }
+      cvec = i_h_t;
+    }
+    if (xs.empty()) return 0;
+    cg.incremental_forward();
+    double loss = 0;
+    unsigned i = 0;
+    for (unsigned k = 0; k < ccpbs.size(); k++){
+      vector<float> ccpb = as_vector(ccpbs[k].value());
+      for (unsigned t = 0; t < slens[k]; t++, i++){
+	vector<float> x = as_vector(xs[i].value());
+	if (rows)
+	  loss += output.quantized_neglogprob(x, nullptr, targets[i]) 
+	    - ccpb[t];
+	else
+	  loss += output.quantized_neglogprob(x, ccpb.data(), targets[i]);
+      }
+    }
+    return loss;
+  }
 };
 
 #endif
@@ -2,14 +2,15 @@
 #define HRNNLM_HPP
 
 #include "util.hpp"
+#include "output-layer.hpp"
 
 template <class Builder>
 class HRNNLM{
 private:
   LookupParameters* p_c; 
   // LookupParameters* p_c2;
-  Parameters* p_R; 
-  Parameters* p_R2; 
+  OutputLayer output; 
+  OutputLayer soutput; 
   Parameters* p_context;
   Parameters* p_bias;
   Parameters* p_bias2;
@@ -21,7 +22,9 @@ public:
   HRNNLM();
   HRNNLM(Model& smodel, Model& wmodel, unsigned nlayers, 
 	 unsigned inputdim, unsigned hiddendim, 
-	 unsigned vocabsize){
+	 unsigned vocabsize, 
+	 const WordClasses* classes = nullptr,
+	 unsigned rank = 0){
     hd = hiddendim;
     // word-level builder
     wbuilder = Builder(nlayers, inputdim+hiddendim, 
@@ -29,7 +32,7 @@ public:
     // word embedding for word level
     p_c = wmodel.add_lookup_parameters(vocabsize, {inputdim}); 
     // word-level output weight metrix
-    p_R = wmodel.add_parameters({vocabsize, hiddendim});
+    output = OutputLayer(wmodel, vocabsize, hiddendim, classes, rank);
     // word-level bias term
     p_bias = wmodel.add_parameters({vocabsize});
     // default context vector
@@ -39,24 +42,37 @@ public:
     // word embedding for sentence level
     // p_c2 = smodel.add_lookup_parameters(vocabsize, {inputdim});
     // sentence-level output weight matrix
-    p_R2 = smodel.add_parameters({vocabsize, hiddendim});
+    soutput = OutputLayer(smodel, vocabsize, hiddendim, classes, rank);
     // sentence-level bias term
     p_bias2 = smodel.add_parameters({vocabsize});
   }
 
-  Expression BuildWordGraph(const Doc doc, ComputationGraph& cg){
+  // train with a sampled softmax, null for exact training
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    output.set_sampler(sampler, nsamples);
+    soutput.set_sampler(sampler, nsamples);
+  }
+
+  // self-normalized training and unnormalized scoring
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    output.set_selfnorm(alpha, unnormalized);
+    soutput.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildWordGraph(const Doc& doc, ComputationGraph& cg){
     // reset RNN builder
     wbuilder.new_graph(cg);
+    output.new_graph(cg);
     // define expression
-    Expression i_R = parameter(cg, p_R);
     Expression i_bias = parameter(cg, p_bias);
     Expression i_context = parameter(cg, p_context);
-    vector<Expression> errs, vec_exp, sentexp;
-    Expression i_x_t, i_h_t, i_y_t, i_err, cvec;
+    vector<Expression> errs, vec_exp, sentexp, hs;
+    vector<unsigned> targets;
+    Expression i_x_t, i_h_t, i_err, cvec;
     // start building rnn
     for (unsigned k = 0; k < doc.size(); k++){
       wbuilder.start_new_sequence();
-      auto sent = doc[k];
+      auto& sent = doc[k];
       // Get context representation (sentence-level 
       //  hidden state from s-level LM
       if (k == 0){
@@ -67,6 +83,7 @@ public:
       }
       // build word-level rnnlm
       unsigned slen = sent.size() - 1;
+      hs.clear(); targets.clear();
       for (unsigned t = 0; t < slen; t++){
 	// get word representation
 	i_x_t = lookup(cg, p_c, sent[t]);
@@ -76,29 +93,30 @@ public:
 	i_x_t = concatenate(vec_exp);
 	// compute hidden state
 	i_h_t = wbuilder.add_input(i_x_t);
-	i_y_t = (i_R * i_h_t);
-	// compute prediction error
-	i_err = pickneglogsoftmax(i_y_t, sent[t+1]);
-	// cerr << as_scalar(i_err.value()) << " ";
-	errs.push_back(i_err);
+	hs.push_back(i_h_t);
+	targets.push_back(sent[t+1]);
       }
+      // compute prediction error of the whole sentence
+      i_err = output.neglogprob(hs, Expression(), targets);
+      // cerr << as_scalar(i_err.value()) << " ";
+      errs.push_back(i_err);
       // cerr << endl;
     }
     Expression i_nerr = sum(errs);
     return i_nerr;
   }
   
-  Expression BuildSentGraph(const Doc doc, ComputationGraph& cg){
+  Expression BuildSentGraph(const Doc& doc, ComputationGraph& cg){
     // reset RNN builder for new graph
     stensor.clear();
     sbuilder.new_graph(cg);  
     sbuilder.start_new_sequence();
-    // define expression
-    Expression i_R2 = parameter(cg, p_R2);
+    soutput.new_graph(cg);
     // -----------------------------------------
     // build sentence level language model for oen doc
-    Expression i_x_t, i_h_t, i_y_t, i_err;
+    Expression i_x_t, i_h_t, i_err;
     vector<Expression> errs;
+    vector<unsigned> targets;
     for (unsigned k = 0; k < doc.size()-1; k++){
       auto& sent = doc[k];
       // ---------------------------------------
@@ -113,19 +131,19 @@ public:
       }
       // compute hidden state
       i_h_t = sbuilder.add_input(i_x_t);
-      // compute prediction for every words in this sent
-      i_y_t = i_R2 * i_h_t;
       // get next sentence
       // cerr << "pick neg log softmax " << endl;
       auto& nextsent = doc[k+1];
-      i_err = pickneglogsoftmax(i_y_t, nextsent[1]);
-      errs.push_back(i_err);
+      targets.clear();
+      targets.push_back(nextsent[1]);
       for (unsigned t = 1; t < nextsent.size() - 1; t++){
-      	// compute predict err
-      	i_err = pickneglogsoftmax(i_y_t, nextsent[t]);
-      	// store
-      	errs.push_back(i_err);
+	// every word in the next sentence is a target
+	targets.push_back(nextsent[t]);
       }
+      // compute prediction errors for all of them from
+      //   one normalization
+      i_err = soutput.neglogprob(i_h_t, Expression(), targets);
+      errs.push_back(i_err);
       cg.incremental_forward();
       vector<float> vf = convertT2V(i_h_t.value());
       stensor.push_back(vf);
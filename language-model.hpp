@@ -0,0 +1,138 @@
+#ifndef LANGUAGE_MODEL_HPP
+#define LANGUAGE_MODEL_HPP
+
+#include "util.hpp"
+#include "output-layer.hpp"
+
+#include <functional>
+#include <map>
+#include <stdexcept>
+
+// ******************************************************
+// Sizes of a language model
+// ******************************************************
+struct ModelConfig {
+  unsigned nlayers, inputdim, hiddendim;
+  unsigned aligndim; // attention layer, for dam
+  unsigned vocabsize;
+  const WordClasses* classes; // null for a full softmax
+  unsigned rank; // of the output layer, 0 for full rank
+};
+
+// ******************************************************
+// Common interface of the language models. A model owns
+//   its parameters, so a run allocates only the model
+//   it uses, and the training and test loops call it
+//   without looking at its name again.
+// ******************************************************
+class LanguageModel {
+public:
+  virtual ~LanguageModel(){}
+
+  // parameters, one Model for each trainer
+  virtual vector<Model*> models() = 0;
+
+  // train with a sampled softmax, null for exact training
+  virtual void set_sampler(const UnigramSampler* sampler,
+			   unsigned nsamples) = 0;
+
+  // self-normalized training and unnormalized scoring
+  virtual void set_selfnorm(float alpha,
+			    bool unnormalized = false) = 0;
+
+  // loss of a document; context is what final_context
+  //   gave after the previous segment of the document,
+  //   null for a new document
+  virtual Expression BuildGraph(const Doc& doc, ComputationGraph& cg,
+				const vector<float>* context = nullptr) = 0;
+
+  // loss of a document as test() reports it, the same as
+  //   BuildGraph unless the model says otherwise
+  virtual Expression BuildTestGraph(const Doc& doc, ComputationGraph& cg){
+    return BuildGraph(doc, cg);
+  }
+
+  // loss of a minibatch of documents, if batched
+  virtual bool batched() const { return false; }
+  virtual Expression BuildBatchGraph(const DocBatch& batch,
+				     ComputationGraph& cg){
+    throw runtime_error("the model does not run minibatches");
+  }
+
+  // whether a context is carried from one segment into
+  //   the next, and the one after the last BuildGraph
+  //   (after forward)
+  virtual bool carries_context() const { return false; }
+  virtual vector<float> final_context(){ return vector<float>(); }
+
+  // one training step on a document, return the loss;
+  //   update(k, learned) is called once the k-th Model
+  //   has its gradients, learned is false if the
+  //   document gave it none
+  virtual double TrainGraph(const Doc& doc,
+			    function<void(unsigned, bool)> update){
+    ComputationGraph cg;
+    BuildGraph(doc, cg);
+    double loss = as_scalar(cg.forward());
+    cg.backward();
+    update(0, true);
+    return loss;
+  }
+
+  // random continuation of a context, if the model can
+  //   sample
+  virtual bool samples() const { return false; }
+  virtual string RandomSample(const Doc& context, ComputationGraph& cg,
+			      cnn::Dict& d){
+    return "";
+  }
+  // score and sample with int8 kernels, once the model 
+  //   is loaded; false if the model has none
+  virtual bool quantize(){ return false; }
+  // whether quantize would succeed (checked before an 
+  //   int8 model is written)
+  virtual bool quantizable() const { return false; }
+  // loss of a document with the int8 kernels, after
+  //   quantize
+  virtual double QuantizedLoss(const Doc& doc){
+    ComputationGraph cg;
+    BuildTestGraph(doc, cg);
+    return as_scalar(cg.forward());
+  }
+
+  // save into / load from fname.model, values in the
+  //   given precision
+  virtual int save(const string& fname, const string& type,
+		   Precision precision = FP32){
+    return save_model(fname, *models()[0], type, precision);
+  }
+  virtual int load(const string& fname, const string& type){
+    return load_model(fname, *models()[0], type);
+  }
+};
+
+// ******************************************************
+// Models by name (the flag on the command line). Each
+//   program registers the models it is built with.
+// ******************************************************
+typedef function<LanguageModel*(const ModelConfig&)> ModelFactory;
+
+inline map<string, ModelFactory>& model_registry(){
+  static map<string, ModelFactory> registry;
+  return registry;
+}
+
+inline bool register_model(const string& name, ModelFactory factory){
+  model_registry()[name] = factory;
+  return true;
+}
+
+// a new model of the given name, null if there is none
+inline unique_ptr<LanguageModel> make_model(const string& name,
+					    const ModelConfig& config){
+  auto it = model_registry().find(name);
+  if (it == model_registry().end()) return nullptr;
+  return unique_ptr<LanguageModel>(it->second(config));
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include "sample.hpp"
 #include <stdlib.h>
 
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+
 int NLAYERS = 2;
 
 // main function
@@ -11,9 +15,77 @@ int main(int argc, char** argv) {
   
   // initialize cnn
   cnn::Initialize(argc, argv);
+  // --------------------------------------------
+  // Optional arguments, everything else is kept as 
+  //   positional arguments in the order shown below
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("batch-size", po::value<unsigned>()->default_value(1), "number of documents per minibatch (train)")
+    ("classes", po::value<unsigned>()->default_value(0), "number of word classes for a factored softmax, 0 for a full softmax (train)")
+    ("samples", po::value<unsigned>()->default_value(0), "number of negatives for sampled softmax training, 0 for a full softmax (train)")
+    ("self-norm", po::value<float>()->default_value(0.0), "weight of the self-normalization penalty, full softmax only (train)")
+    ("threads", po::value<unsigned>()->default_value(1), "number of hogwild training workers (train)")
+    ("procs", po::value<unsigned>()->default_value(1), "number of synchronous data-parallel processes (train)")
+    ("accumulate", po::value<unsigned>()->default_value(1), "number of steps whose gradients are averaged before each update (train)")
+    ("shuffle-block", po::value<unsigned>()->default_value(0), "shuffle blocks of this many neighbouring documents, 0 for a full shuffle (train)")
+    ("min-count", po::value<unsigned>()->default_value(0), "words seen fewer times become UNK (train)")
+    ("vocab-size", po::value<unsigned>()->default_value(0), "keep only this many most frequent words, 0 for all (train)")
+    ("token-budget", po::value<unsigned>()->default_value(0), "pack documents into units of at most this many tokens, 0 for pieces of 6 sentences (train)")
+    ("carry-context", "train documents segment by segment, carrying the context forward (train)")
+    ("stream", "train online, reading the training file (or - for stdin) while training (train)")
+    ("reservoir", po::value<unsigned>()->default_value(0), "shuffle streamed documents through a buffer of this many, 0 for stream order (train)")
+    ("dict", po::value<string>()->default_value(""), "read the dict (and word classes) of this model prefix (train)")
+    ("rank", po::value<unsigned>()->default_value(0), "rank of a factored output layer, 0 for a full matrix (train)")
+    ("precision", po::value<string>()->default_value("fp32"), "values of saved model files: fp32, or fp16 / bf16 for half the file size, int8 for a quarter; loaded models are fp32 in memory (train)")
+    ("exact", "normalize scores of self-normalized models (test)");
+  po::options_description hidden;
+  hidden.add_options()
+    ("args", po::value<vector<string>>(), "positional arguments");
+  po::options_description all;
+  all.add(desc).add(hidden);
+  po::positional_options_description p;
+  p.add("args", -1);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).
+	    options(all).positional(p).run(), vm);
+  po::notify(vm);
+  BATCH_SIZE = vm["batch-size"].as<unsigned>();
+  NUM_CLASSES = vm["classes"].as<unsigned>();
+  NUM_SAMPLES = vm["samples"].as<unsigned>();
+  SELF_NORM = vm["self-norm"].as<float>();
+  OUTPUT_RANK = vm["rank"].as<unsigned>();
+  NUM_THREADS = vm["threads"].as<unsigned>();
+  NUM_PROCS = vm["procs"].as<unsigned>();
+  ACCUM_STEPS = vm["accumulate"].as<unsigned>();
+  SHUFFLE_BLOCK = vm["shuffle-block"].as<unsigned>();
+  MIN_COUNT = vm["min-count"].as<unsigned>();
+  MAX_VOCAB = vm["vocab-size"].as<unsigned>();
+  TOKEN_BUDGET = vm["token-budget"].as<unsigned>();
+  CARRY_CONTEXT = vm.count("carry-context");
+  STREAM = vm.count("stream");
+  RESERVOIR = vm["reservoir"].as<unsigned>();
+  DICT_PREFIX = vm["dict"].as<string>();
+  EXACT_SCORING = vm.count("exact");
+  int precision = parse_precision(vm["precision"].as<string>());
+  if (precision < 0){
+    cerr << "Unknown precision " << vm["precision"].as<string>() << endl;
+    return -1;
+  }
+  MODEL_PRECISION = (Precision)precision;
+  vector<string> args;
+  args.push_back(argv[0]);
+  if (vm.count("args")) 
+    for (auto& arg : vm["args"].as<vector<string>>())
+      args.push_back(arg);
+  argc = args.size();
+  for (int i = 0; i < argc; i++) 
+    argv[i] = (char*) args[i].c_str();
   // check arguments
   cout << "Number of arguments " << argc << endl;
-  if (argc < 5) {
+  // encode and precision take two arguments, not three
+  bool three_arg_cmd = (argc == 4) && ((string(argv[1]) == "encode")
+				       || (string(argv[1]) == "precision"));
+  if ((argc < 5) && !three_arg_cmd) {
     cerr << "============================\n"
 	 << "Usage: \n" 
 	 << "\t" << argv[0] 
@@ -21,7 +93,14 @@ int main(int argc, char** argv) {
 	 << "\t" << argv[0] 
 	 << " test model_prefix test_file flag\n"
 	 << "\t" << argv[0]
-	 << " sample model_prefix test_file flag\n";
+	 << " sample model_prefix test_file flag\n"
+	 << "\t" << argv[0]
+	 << " encode text_file archive_file\n"
+	 << "\t" << argv[0]
+	 << " precision model_file fp32|fp16|bf16|int8\n"
+	 << "\t" << argv[0]
+	 << " quantize model_prefix test_file flag\n"
+	 << desc;
     return -1;
   }
   // parse command arguments
@@ -31,6 +110,14 @@ int main(int argc, char** argv) {
     char* ftrn = argv[2];
     char* fdev = argv[3];
     string flag = string(argv[4]);
+    // the penalty only applies to a full softmax trained
+    //   exactly, at the word level
+    if ((SELF_NORM > 0) && ((NUM_CLASSES > 0) || (NUM_SAMPLES > 0) 
+			    || (flag == "hrnnlm"))){
+      cerr << "--self-norm cannot be used with --classes, --samples"
+	   << " or hrnnlm" << endl;
+      return -1;
+    }
     unsigned inputdim = 16;
     unsigned hiddendim = 48;
     float lr0 = 0.1; // initial learning rate
@@ -58,6 +145,37 @@ int main(int argc, char** argv) {
     string flag(argv[4]);
     randomsample(fcont, prefix, flag);
   }
+  else if(cmd == "quantize"){
+    // the model in int8 under model_prefix.int8, with
+    //   its perplexity on test_file before and after
+    cout << "Task: " << argv[1] << endl;
+    char* prefix = argv[2];
+    char* ftst = argv[3];
+    string flag(argv[4]);
+    if (quantize(ftst, prefix, flag) != 0) return -1;
+  }
+  else if(cmd == "encode"){
+    // a compressed archive, which any command reads in 
+    //   place of the text file
+    cout << "Task: " << argv[1] << endl;
+    cnn::Dict d;
+    Corpus corpus = parseData(argv[2], &d, true);
+    if (save_archive(argv[3], corpus, &d) != 0){
+      cerr << "Cannot write " << argv[3] << endl;
+      return -1;
+    }
+  }
+  else if(cmd == "precision"){
+    // rewrite a saved model (model_file.model) in another
+    //   precision
+    cout << "Task: " << argv[1] << endl;
+    int precision = parse_precision(argv[3]);
+    if (precision < 0){
+      cerr << "Unknown precision " << argv[3] << endl;
+      return -1;
+    }
+    if (convert_model(argv[2], (Precision)precision) != 0) return -1;
+  }
   else{
     cerr << "Unrecognized command " << argv[1]<<endl;
   }
@@ -0,0 +1,450 @@
+#ifndef OUTPUT_LAYER_HPP
+#define OUTPUT_LAYER_HPP
+
+#include "util.hpp"
+
+#include <deque>
+
+// ********************************************************
+// Output layer shared by all language models: scores the
+//   vocabulary from hidden states and computes the
+//   negative log-likelihood of the target words.
+//
+// With word classes, the softmax is factored into
+//   p(w|h) = p(class(w)|h) * p(w|class(w),h), so each
+//   token only normalizes over the classes and over the
+//   words of its own class.
+//
+// With a sampler (training only), a full softmax is
+//   replaced by a sampled softmax: every sequence is
+//   normalized over its targets and a few negatives drawn
+//   from a unigram distribution, with scores corrected by
+//   the log expected count of each candidate.
+//
+// With self-normalization, training adds alpha*(log Z)^2
+//   per token to push the partition function towards 1;
+//   such a model can then be scored without normalizing,
+//   from the target rows of the output layer only.
+//
+// With a rank r > 0, the VxK2 output matrix is factored
+//   into Vxr and rxK2 matrices: hidden states are first
+//   projected down to r dimensions, and everything above
+//   (classes, sampling, scoring) works on the projection.
+//
+// For sampling, a full softmax can also be computed from
+//   an int8 copy of the output layer, off the graph.
+// ********************************************************
+class OutputLayer{
+private:
+  Parameters* p_R; // output layer: VxK2 (or Vxr)
+  Parameters* p_W; // projection for a low-rank layer: rxK2
+  Parameters* p_Rc; // class output layer: CxK2 (or Cxr)
+  Parameters* p_biasc; // class bias Cx1
+  const WordClasses* classes; // null for a full softmax
+  const UnigramSampler* sampler; // null for exact training
+  unsigned nsamples; // number of negatives per sequence
+  float selfnorm; // weight of the self-normalization penalty
+  bool unnormalized; // score without computing log Z
+  unsigned vocabsize, hiddendim, rank;
+  ComputationGraph* pcg;
+  Expression i_R, i_W, i_Rc, i_biasc;
+  // rows of i_R for each class, built once per graph
+  std::unordered_map<unsigned, Expression> crows;
+  // constant inputs, kept alive until the graph is evaluated
+  std::deque<vector<float>> consts;
+  QuantizedMatrix qR; // int8 copy of p_R, empty if none
+
+  Expression constant(const Dim& dim, const vector<float>& vals){
+    consts.push_back(vals);
+    return input(*pcg, dim, &consts.back());
+  }
+
+  // a row of n ones, to add a bias vector to n columns
+  Expression ones(unsigned n){
+    return constant({1, n}, vector<float>(n, 1.0));
+  }
+
+  // project hidden states down to the rank of the layer
+  Expression project(const Expression& i_h){
+    if (rank == 0) return i_h;
+    return i_W * i_h;
+  }
+
+  // scores of all words, from projected hidden states
+  Expression full_scores(const Expression& i_x,
+			 const Expression& i_bias){
+    if (i_bias.pg == nullptr) return i_R * i_x;
+    return affine_transform({i_bias, i_R, i_x});
+  }
+
+  // rows of the output layer for the words of class c
+  Expression class_rows(unsigned c){
+    auto it = crows.find(c);
+    if (it != crows.end()) return it->second;
+    Expression i_Rw = select_rows(i_R, classes->members[c]);
+    crows[c] = i_Rw;
+    return i_Rw;
+  }
+
+  // scores of the words in class c
+  Expression class_scores(unsigned c, const Expression& i_h,
+			  const Expression& i_bias){
+    if (i_bias.pg == nullptr) return class_rows(c) * i_h;
+    return affine_transform({select_rows(i_bias, classes->members[c]),
+	  class_rows(c), i_h});
+  }
+
+  // word-level error of one time step in class mode, one
+  //   target per lane. Lanes predicting words of different
+  //   classes share one product over the union of their
+  //   classes, and rows outside a lane's class are masked.
+  Expression word_neglogprob(const Expression& i_h,
+			     const Expression& i_bias,
+			     const vector<unsigned>& targets){
+    vector<unsigned> cls, pos;
+    for (auto& w : targets){
+      cls.push_back(classes->word2class[w]);
+      pos.push_back(classes->word2pos[w]);
+    }
+    if (std::count(cls.begin(), cls.end(), cls[0]) == (int) cls.size())
+      return pickneglogsoftmax(class_scores(cls[0], i_h, i_bias), pos);
+    vector<unsigned> ucls(cls), rows;
+    sort(ucls.begin(), ucls.end());
+    ucls.erase(unique(ucls.begin(), ucls.end()), ucls.end());
+    std::unordered_map<unsigned, unsigned> offset;
+    for (auto& c : ucls){
+      offset[c] = rows.size();
+      auto& members = classes->members[c];
+      rows.insert(rows.end(), members.begin(), members.end());
+    }
+    const unsigned nrows = rows.size(), nlanes = targets.size();
+    vector<float> mask(nrows * nlanes, -1e20);
+    for (unsigned b = 0; b < nlanes; b++){
+      unsigned off = offset[cls[b]];
+      unsigned csize = classes->members[cls[b]].size();
+      for (unsigned r = off; r < off + csize; r++)
+	mask[b * nrows + r] = 0.0;
+      pos[b] += off;
+    }
+    Expression i_Rw = select_rows(i_R, rows);
+    Expression i_Y = i_Rw * i_h;
+    if (i_bias.pg != nullptr)
+      i_Y = affine_transform({select_rows(i_bias, rows), i_Rw, i_h});
+    i_Y = i_Y + constant(Dim({nrows}, nlanes), mask);
+    return pickneglogsoftmax(i_Y, pos);
+  }
+
+  // candidate words for a sampled softmax: the targets plus
+  //   nsamples negatives, and the correction of each one
+  vector<unsigned> candidates(const vector<unsigned>& targets,
+			      vector<float>& corrections,
+			      vector<unsigned>& pos){
+    vector<unsigned> cands(targets);
+    for (unsigned i = 0; i < nsamples; i++)
+      cands.push_back(sampler->sample());
+    sort(cands.begin(), cands.end());
+    cands.erase(unique(cands.begin(), cands.end()), cands.end());
+    corrections.clear();
+    for (auto& w : cands)
+      corrections.push_back(-(log((float)nsamples) + sampler->logq[w]));
+    pos.clear();
+    for (auto& w : targets)
+      pos.push_back(lower_bound(cands.begin(), cands.end(), w)
+		    - cands.begin());
+    return cands;
+  }
+
+  // error without normalization: log Z is taken to be 0,
+  //   so only the target rows are needed, O(K2) per token.
+  //   i_bt holds the bias of each target, if any.
+  Expression target_neglogprob(const Expression& i_H,
+			       const Expression& i_bt,
+			       const vector<unsigned>& targets,
+			       const vector<float>& masks){
+    const unsigned slen = targets.size();
+    Expression i_Rt = select_rows(i_R, targets);
+    Expression i_y = sum_cols(cwise_multiply(i_Rt, transpose(i_H)));
+    if (i_bt.pg != nullptr) i_y = i_y + i_bt;
+    vector<float> weights(masks);
+    if (weights.size() == 0) weights.assign(slen, 1.0);
+    return -dot_product(i_y, constant({slen}, weights));
+  }
+
+  // sum of per-target errors, ignoring masked ones
+  Expression masked_sum(const Expression& i_err,
+			const vector<float>& masks){
+    if (masks.size() == 0) return sum_batches(i_err);
+    Expression i_mask = constant(Dim({1}, masks.size()), masks);
+    return sum_batches(cwise_multiply(i_err, i_mask));
+  }
+
+public:
+  OutputLayer(){}
+  OutputLayer(Model& model, unsigned vocabsize,
+	      unsigned hiddendim,
+	      const WordClasses* classes = nullptr,
+	      unsigned rank = 0):sampler(nullptr),
+						    nsamples(0),
+						    selfnorm(0.0),
+						    unnormalized(false),
+						    vocabsize(vocabsize),
+						    hiddendim(hiddendim),
+						    rank(rank){
+    unsigned indim = hiddendim;
+    if (rank > 0){
+      // V x r times r x K2, instead of V x K2
+      indim = rank;
+      p_R = model.add_parameters({vocabsize, rank});
+      p_W = model.add_parameters({rank, hiddendim});
+    } else {
+      p_R = model.add_parameters({vocabsize, hiddendim});
+    }
+    // no classes at all means a full softmax
+    if ((classes != nullptr) && (classes->size() == 0))
+      classes = nullptr;
+    this->classes = classes;
+    if (classes != nullptr){
+      p_Rc = model.add_parameters({classes->size(), indim});
+      p_biasc = model.add_parameters({classes->size()});
+    }
+  }
+
+  // ------------------------------------------------
+  // train with a sampled softmax, or exactly if sampler
+  //   is null. Has no effect with word classes.
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    this->sampler = sampler;
+    this->nsamples = nsamples;
+  }
+
+  // ------------------------------------------------
+  // self-normalized training (alpha > 0) and scoring
+  //   without normalization. Both only apply to a full
+  //   softmax over single-lane sequences.
+  void set_selfnorm(float alpha, bool unnormalized){
+    this->selfnorm = alpha;
+    this->unnormalized = unnormalized;
+  }
+
+  // whether a single-lane neglogprob only reads the 
+  //   target rows of the bias, so a caller can compute 
+  //   just those (see neglogprob_targets)
+  bool scores_targets() const {
+    return (classes == nullptr) && (sampler == nullptr) && unnormalized;
+  }
+
+  // single-lane neglogprob without normalization, with the
+  //   bias of each target given in i_bt (slen x 1) instead
+  //   of a bias vector over the vocabulary
+  Expression neglogprob_targets(const vector<Expression>& hs,
+				const Expression& i_bt,
+				const vector<unsigned>& targets){
+    return target_neglogprob(project(concatenate_cols(hs)), i_bt,
+			     targets, vector<float>());
+  }
+
+  void new_graph(ComputationGraph& cg){
+    pcg = &cg;
+    consts.clear();
+    crows.clear();
+    // a quantized layer scores off the graph, from qR
+    if (!quantized()) i_R = parameter(cg, p_R);
+    if (rank > 0) i_W = parameter(cg, p_W);
+    if (classes != nullptr){
+      i_Rc = parameter(cg, p_Rc);
+      i_biasc = parameter(cg, p_biasc);
+    }
+  }
+
+  // ------------------------------------------------
+  // unnormalized scores of all words for one hidden
+  //   state (plus bias, if given), full softmax only
+  Expression scores(const Expression& i_h,
+		    const Expression& i_bias = Expression()){
+    return full_scores(project(i_h), i_bias);
+  }
+
+  // ------------------------------------------------
+  // keep an int8 copy of the (loaded) output layer for
+  //   quantized_logprobs, full softmax only. The fp32 
+  //   values of p_R are given back to the system, so the
+  //   layer can no longer be used on the graph (or saved)
+  //   afterwards.
+  bool quantizable() const { return classes == nullptr; }
+  bool quantize(){
+    if (!quantizable()) return false;
+    if (quantized()) return true;
+    qR.quantize(p_R->values.v, p_R->dim.d[0], p_R->dim.d[1]);
+    release_values(p_R->values.v, p_R->dim.size());
+    return true;
+  }
+  bool quantized() const { return !qR.empty(); }
+
+  // hidden state projected down to the rank of the layer,
+  //   the input of quantized_logprobs
+  Expression projection(const Expression& i_h){
+    return project(i_h);
+  }
+
+  // log-probabilities of all words from the value of a
+  //   projection, with the int8 copy of the layer
+  vector<float> quantized_logprobs(const vector<float>& x,
+				   const float* bias = nullptr) const {
+    vector<float> y(vocabsize);
+    qR.multiply(x.data(), y.data(), bias);
+    float ymax = *std::max_element(y.begin(), y.end());
+    double z = 0;
+    for (auto& v : y) z += exp(v - ymax);
+    float logz = ymax + log(z);
+    for (auto& v : y) v -= logz;
+    return y;
+  }
+
+  // error of a target from the value of a projection, 
+  //   with the int8 copy of the layer; without 
+  //   normalization only its row is computed
+  double quantized_neglogprob(const vector<float>& x, const float* bias,
+			      unsigned target) const {
+    if (unnormalized){
+      double y = qR.multiply_row(target, x.data());
+      return (bias != nullptr) ? -(y + bias[target]) : -y;
+    }
+    return -quantized_logprobs(x, bias)[target];
+  }
+
+  // ------------------------------------------------
+  // log-probabilities of all words for one hidden state,
+  //   e.g. for sampling
+  Expression logprobs(const Expression& i_h0,
+		      const Expression& i_bias = Expression()){
+    Expression i_h = project(i_h0);
+    if (classes == nullptr) return log_softmax(full_scores(i_h, i_bias));
+    Expression i_lpc = log_softmax(affine_transform({i_biasc, i_Rc, i_h}));
+    vector<Expression> lps;
+    vector<unsigned> offset(classes->size(), 0), perm(vocabsize);
+    unsigned off = 0;
+    for (unsigned c = 0; c < classes->size(); c++){
+      unsigned csize = classes->members[c].size();
+      offset[c] = off; off += csize;
+      // log p(c) + log p(w|c) for every word w in c
+      Expression i_ones = constant({csize}, vector<float>(csize, 1.0));
+      lps.push_back(log_softmax(class_scores(c, i_h, i_bias))
+		    + i_ones * pick(i_lpc, c));
+    }
+    // back to the order of word indices
+    for (unsigned w = 0; w < vocabsize; w++)
+      perm[w] = offset[classes->word2class[w]] + classes->word2pos[w];
+    return select_rows(concatenate(lps), perm);
+  }
+
+  // ------------------------------------------------
+  // negative log-likelihood of a whole sequence: the
+  //   hidden states are put in one K2xT matrix, scored
+  //   with a single matrix product and normalized with
+  //   one batched log-softmax. Hidden states may carry
+  //   B lanes, then targets (and masks, if given) are
+  //   ordered lane by lane, T entries each.
+  Expression neglogprob(const vector<Expression>& hs,
+			const Expression& i_bias,
+			const vector<unsigned>& targets,
+			const vector<float>& masks = vector<float>()){
+    const unsigned slen = hs.size();
+    const unsigned nlanes = targets.size() / slen;
+    Expression i_H = project(concatenate_cols(hs));
+    if ((classes == nullptr) && (sampler != nullptr)){
+      vector<float> corrections;
+      vector<unsigned> pos;
+      vector<unsigned> cands = candidates(targets, corrections, pos);
+      const unsigned ncands = cands.size();
+      // scores of the candidates only, corrected by the
+      //   log expected count of each of them
+      Expression i_Y = select_rows(i_R, cands) * i_H;
+      Expression i_corr = constant({ncands}, corrections);
+      if (i_bias.pg != nullptr)
+	i_corr = i_corr + select_rows(i_bias, cands);
+      i_Y = affine_transform({i_Y, i_corr, ones(slen)});
+      i_Y = reshape(i_Y, Dim({ncands}, targets.size()));
+      return masked_sum(pickneglogsoftmax(i_Y, pos), masks);
+    }
+    if ((classes == nullptr) && unnormalized && (nlanes == 1)){
+      Expression i_bt;
+      if (i_bias.pg != nullptr) i_bt = select_rows(i_bias, targets);
+      return target_neglogprob(i_H, i_bt, targets, masks);
+    }
+    if (classes == nullptr){
+      Expression i_Y = i_R * i_H;
+      // add the bias vector to every column
+      if (i_bias.pg != nullptr)
+	i_Y = affine_transform({i_Y, i_bias, ones(slen)});
+      // one column per batch element, so log-softmax runs
+      //   over all time steps (and lanes) at once
+      i_Y = reshape(i_Y, Dim({vocabsize}, targets.size()));
+      Expression i_err = pickneglogsoftmax(i_Y, targets);
+      if (selfnorm > 0){
+	// log Z = y_target - log p(target)
+	Expression i_logz = pick(i_Y, targets) + i_err;
+	i_err = i_err + selfnorm * square(i_logz);
+      }
+      return masked_sum(i_err, masks);
+    }
+    // class part, fused over the sequence
+    vector<unsigned> ctargets;
+    for (auto& w : targets) ctargets.push_back(classes->word2class[w]);
+    Expression i_Yc = affine_transform({i_biasc * ones(slen), i_Rc, i_H});
+    i_Yc = reshape(i_Yc, Dim({classes->size()}, targets.size()));
+    vector<Expression> errs;
+    errs.push_back(masked_sum(pickneglogsoftmax(i_Yc, ctargets), masks));
+    // word part, one time step (all lanes) at a time
+    for (unsigned t = 0; t < slen; t++){
+      vector<unsigned> wtargets;
+      vector<float> wmasks;
+      for (unsigned b = 0; b < nlanes; b++){
+	wtargets.push_back(targets[b * slen + t]);
+	if (masks.size() > 0) wmasks.push_back(masks[b * slen + t]);
+      }
+      Expression i_x = project(hs[t]);
+      errs.push_back(masked_sum(word_neglogprob(i_x, i_bias, wtargets),
+				wmasks));
+    }
+    return sum(errs);
+  }
+
+  // ------------------------------------------------
+  // negative log-likelihood of several targets predicted
+  //   from the same hidden state
+  Expression neglogprob(const Expression& i_h0,
+			const Expression& i_bias,
+			const vector<unsigned>& targets){
+    Expression i_h = project(i_h0);
+    vector<Expression> errs;
+    if ((classes == nullptr) && (sampler != nullptr)){
+      vector<float> corrections;
+      vector<unsigned> pos;
+      vector<unsigned> cands = candidates(targets, corrections, pos);
+      Expression i_corr = constant({(unsigned)cands.size()}, corrections);
+      if (i_bias.pg != nullptr)
+	i_corr = i_corr + select_rows(i_bias, cands);
+      Expression i_lp = log_softmax(affine_transform({i_corr,
+	      select_rows(i_R, cands), i_h}));
+      for (auto& p : pos) errs.push_back(-pick(i_lp, p));
+      return sum(errs);
+    }
+    if (classes == nullptr){
+      Expression i_lp = log_softmax(full_scores(i_h, i_bias));
+      for (auto& w : targets) errs.push_back(-pick(i_lp, w));
+      return sum(errs);
+    }
+    Expression i_lpc = log_softmax(affine_transform({i_biasc, i_Rc, i_h}));
+    std::unordered_map<unsigned, Expression> lpw;
+    for (auto& w : targets){
+      unsigned c = classes->word2class[w];
+      if (lpw.find(c) == lpw.end())
+	lpw[c] = log_softmax(class_scores(c, i_h, i_bias));
+      errs.push_back(-(pick(i_lpc, c)
+		       + pick(lpw[c], classes->word2pos[w])));
+    }
+    return sum(errs);
+  }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+// ******************************************************
+// anonymous memory that survives fork() as shared
+// ******************************************************
+static void* shared_alloc(size_t bytes){
+  void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) throw bad_alloc();
+  return mem;
+}
+
+// ******************************************************
+// Move the parameter values of a model into shared
+//   memory, gradients stay private to each process. All
+//   tensors of the model go into one mapping, so a large
+//   vocabulary does not cost a mapping per row.
+// ******************************************************
+void share_model(Model& model){
+  vector<Tensor*> tensors;
+  for (auto p : model.parameters_list())
+    tensors.push_back(&p->values);
+  for (auto p : model.lookup_parameters_list())
+    for (auto& t : p->values)
+      tensors.push_back(&t);
+  // every tensor starts on a 64-byte boundary
+  auto padded = [](size_t n){ return (n + 15) / 16 * 16; };
+  size_t nfloats = 0;
+  for (auto t : tensors) nfloats += padded(t->d.size());
+  if (nfloats == 0) return;
+  float* v = static_cast<float*>(shared_alloc(nfloats * sizeof(float)));
+  for (auto t : tensors){
+    memcpy(v, t->v, t->d.size() * sizeof(float));
+    t->v = v;
+    v += padded(t->d.size());
+  }
+}
+
+Hogwild::Hogwild(unsigned nworkers):nworkers(nworkers){
+  cursor = new (shared_alloc(sizeof(atomic<unsigned>)))
+    atomic<unsigned>(0);
+  losses = static_cast<double*>(shared_alloc(nworkers * sizeof(double)));
+}
+
+Hogwild::~Hogwild(){
+  munmap(cursor, sizeof(atomic<unsigned>));
+  munmap(losses, nworkers * sizeof(double));
+}
+
+// ******************************************************
+// fork the workers, wait for all of them and collect
+//   their losses
+// ******************************************************
+int Hogwild::run(unsigned nsteps, function<double(unsigned)> step,
+		 double& loss, function<void()> finish){
+  cursor->store(0);
+  for (unsigned w = 0; w < nworkers; w++) losses[w] = 0;
+  // workers must not share random draws (e.g. negatives
+  //   of a sampled softmax)
+  unsigned seed = (*rndeng)();
+  vector<pid_t> pids;
+  for (unsigned w = 0; w < nworkers; w++){
+    pid_t pid = fork();
+    if (pid < 0) break;
+    if (pid == 0){
+      // do not outlive the trainer
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      rndeng->seed(seed + w);
+      unsigned k;
+      while ((k = cursor->fetch_add(1)) < nsteps)
+	losses[w] += step(k);
+      // whatever the worker has not applied dies with it
+      if (finish) finish();
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  int ret = (pids.size() == nworkers) ? 0 : -1;
+  for (auto pid : pids){
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) ret = -1;
+  }
+  loss = 0;
+  for (unsigned w = 0; w < nworkers; w++) loss += losses[w];
+  return ret;
+}
+
+// ******************************************************
+// lay out one gradient slot per process (plus a list
+//   of its lookup rows with gradients) in a POSIX
+//   shared-memory segment
+// ******************************************************
+DataParallel::DataParallel(unsigned nprocs, const vector<Model*>& models)
+  :nprocs(nprocs), rank(0), models(models), nfloats(0), nrows(0),
+   bytes(0), segment(nullptr){
+  if (nprocs <= 1) return;
+  for (auto m : models){
+    offsets.push_back(nfloats);
+    rowoffsets.push_back(nrows);
+    for (auto p : m->parameters_list())
+      nfloats += p->g.d.size();
+    for (auto p : m->lookup_parameters_list()){
+      nfloats += p->values.size() * p->dim.size();
+      nrows += p->values.size();
+    }
+  }
+  size_t head = (sizeof(pthread_barrier_t) + 63) / 64 * 64;
+  bytes = head + nprocs * (sizeof(double) + sizeof(uint32_t)
+			   + nfloats * sizeof(float)
+			   + nrows * sizeof(uint32_t));
+  ostringstream name;
+  name << "/dclm-" << getpid();
+  int fd = shm_open(name.str().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) throw runtime_error("cannot create " + name.str());
+  // the name is not needed once the segment is mapped
+  shm_unlink(name.str().c_str());
+  if (ftruncate(fd, bytes) != 0){
+    close(fd);
+    throw runtime_error("cannot size " + name.str());
+  }
+  segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) throw bad_alloc();
+  char* base = static_cast<char*>(segment);
+  barrier = reinterpret_cast<pthread_barrier_t*>(base);
+  values = reinterpret_cast<double*>(base + head);
+  nlisted = reinterpret_cast<uint32_t*>(values + nprocs);
+  grads = reinterpret_cast<float*>(nlisted + nprocs);
+  listed = reinterpret_cast<uint32_t*>(grads + nprocs * nfloats);
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(barrier, &attr, nprocs);
+  pthread_barrierattr_destroy(&attr);
+}
+
+DataParallel::~DataParallel(){
+  if (segment == nullptr) return;
+  if (rank == 0) pthread_barrier_destroy(barrier);
+  munmap(segment, bytes);
+}
+
+unsigned DataParallel::start(){
+  if (nprocs <= 1) return rank;
+  // processes must not share random draws (e.g. negatives
+  //   of a sampled softmax)
+  unsigned seed = (*rndeng)();
+  rndeng->seed(seed);
+  for (unsigned r = 1; r < nprocs; r++){
+    pid_t pid = fork();
+    if (pid < 0) throw runtime_error("cannot fork a training process");
+    if (pid == 0){
+      // do not outlive the trainer
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      rank = r;
+      rndeng->seed(seed + r);
+      break;
+    }
+  }
+  return rank;
+}
+
+void DataParallel::wait(){
+  if (nprocs > 1) pthread_barrier_wait(barrier);
+}
+
+double DataParallel::sum(double x){
+  if (nprocs <= 1) return x;
+  values[rank] = x;
+  wait();
+  double total = 0;
+  for (unsigned r = 0; r < nprocs; r++) total += values[r];
+  wait();
+  return total;
+}
+
+// ******************************************************
+// every process publishes its gradients, then adds up
+//   all slots in the same order, so the sums are equal
+//   to the last bit in every process. Lookup tables only
+//   exchange the rows in non_zero_grads, so a step costs
+//   nothing per row it does not touch.
+// ******************************************************
+void DataParallel::sum_gradients(Model& model){
+  if (nprocs <= 1) return;
+  unsigned m = find(models.begin(), models.end(), &model) - models.begin();
+  size_t off = offsets[m], row = rowoffsets[m];
+  float* mine = grads + rank * nfloats;
+  uint32_t* myrows = listed + rank * nrows;
+  uint32_t nmine = 0;
+  for (auto p : model.parameters_list()){
+    size_t n = p->g.d.size();
+    memcpy(mine + off, p->g.v, n * sizeof(float));
+    off += n;
+  }
+  // rows are listed table by table, in model order
+  for (auto p : model.lookup_parameters_list()){
+    size_t n = p->dim.size();
+    for (auto i : p->non_zero_grads){
+      myrows[nmine++] = row + i;
+      memcpy(mine + off + i * n, p->grads[i].v, n * sizeof(float));
+    }
+    row += p->values.size();
+    off += p->values.size() * n;
+  }
+  nlisted[rank] = nmine;
+  wait();
+  off = offsets[m];
+  for (auto p : model.parameters_list()){
+    size_t n = p->g.d.size();
+    float* g = p->g.v;
+    memcpy(g, grads + off, n * sizeof(float));
+    for (unsigned r = 1; r < nprocs; r++){
+      const float* other = grads + r * nfloats + off;
+      for (size_t j = 0; j < n; j++) g[j] += other[j];
+    }
+    off += n;
+  }
+  // clear every row listed by any process, then add the
+  //   rows of each process in rank order
+  vector<size_t> firstrow, firstoff;
+  row = rowoffsets[m];
+  for (auto p : model.lookup_parameters_list()){
+    firstrow.push_back(row);
+    firstoff.push_back(off);
+    row += p->values.size();
+    off += p->values.size() * p->dim.size();
+  }
+  auto& lookups = model.lookup_parameters_list();
+  for (unsigned pass = 0; pass < 2; pass++){
+    for (unsigned r = 0; r < nprocs; r++){
+      const uint32_t* rows = listed + r * nrows;
+      unsigned k = 0;
+      for (uint32_t j = 0; j < nlisted[r]; j++){
+	while (rows[j] >= firstrow[k] + lookups[k]->values.size()) k++;
+	auto p = lookups[k];
+	unsigned i = rows[j] - firstrow[k];
+	size_t n = p->dim.size();
+	float* g = p->grads[i].v;
+	if (pass == 0){
+	  memset(g, 0, n * sizeof(float));
+	  p->non_zero_grads.insert(i);
+	  continue;
+	}
+	const float* other = grads + r * nfloats + firstoff[k] + i * n;
+	for (size_t d = 0; d < n; d++) g[d] += other[d];
+      }
+    }
+  }
+  wait();
+}
@@ -0,0 +1,89 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include "cnn/cnn.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <pthread.h>
+
+using namespace std;
+using namespace cnn;
+
+// ******************************************************
+// Move the parameter values of a model into memory that
+//   is shared with forked worker processes, so updates
+//   made by any worker are seen by all of them. Call it
+//   after the model is loaded.
+// ******************************************************
+void share_model(Model& model);
+
+// ******************************************************
+// Hogwild training: worker processes pull steps from a
+//   shared cursor and update the shared model without
+//   any locking. Workers are processes rather than
+//   threads, since cnn keeps one computation graph per
+//   process.
+// ******************************************************
+class Hogwild {
+private:
+  unsigned nworkers;
+  atomic<unsigned>* cursor; // next step to run
+  double* losses; // one slot per worker
+
+public:
+  Hogwild(unsigned nworkers);
+  ~Hogwild();
+
+  // run step(k) for k = 0..nsteps-1 on all workers and
+  //   sum up the returned losses, return -1 if any
+  //   worker failed. finish, if given, runs in each 
+  //   worker after its last step, e.g. to apply the
+  //   gradients it has summed so far.
+  int run(unsigned nsteps, function<double(unsigned)> step,
+	  double& loss, function<void()> finish = nullptr);
+};
+
+// ******************************************************
+// Synchronous data-parallel training: each process keeps
+//   its own copy of the models and computes gradients on
+//   its own share of every step. Gradients are summed in
+//   rank order through a POSIX shared-memory segment
+//   before the common update, so all copies stay equal.
+// ******************************************************
+class DataParallel {
+private:
+  unsigned nprocs, rank;
+  vector<Model*> models;
+  vector<size_t> offsets; // first gradient value of each model
+  vector<size_t> rowoffsets; // first lookup row of each model
+  size_t nfloats, nrows, bytes;
+  void* segment;
+  pthread_barrier_t* barrier;
+  double* values; // one slot per process
+  uint32_t* nlisted; // one count per process
+  float* grads; // nprocs x nfloats
+  uint32_t* listed; // nprocs x nrows, lookup rows with gradients
+
+public:
+  DataParallel(unsigned nprocs, const vector<Model*>& models);
+  ~DataParallel();
+
+  // fork the other processes, return the rank of the
+  //   caller: 0 for the original process
+  unsigned start();
+  unsigned get_rank() const { return rank; }
+
+  // replace the gradients of a model by their sum over
+  //   all processes
+  void sum_gradients(Model& model);
+
+  // sum of a value over all processes
+  double sum(double x);
+
+  // wait until all processes get here
+  void wait();
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "util.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// ******************************************************
+// A queue of at most capacity items between one producer
+//   and one consumer thread. push blocks while the queue
+//   is full and pop while it is empty; after close both
+//   return false (pop once the queue is drained). The
+//   producer calls ready before preparing an item, which
+//   waits for room, and the consumer can hold it there.
+// ******************************************************
+template <class T>
+class BoundedQueue {
+private:
+  size_t capacity;
+  bool closed;
+  bool held; // the producer has to wait in ready
+  bool waiting; // the producer waits in ready
+  deque<T> items;
+  mutex lock;
+  condition_variable not_full, not_empty, idle;
+
+public:
+  BoundedQueue(size_t capacity):capacity(capacity), closed(false),
+				held(false), waiting(false){}
+
+  // wait until an item can be pushed without blocking and
+  //   the queue is not held, false once it is closed
+  bool ready(){
+    unique_lock<mutex> guard(lock);
+    waiting = true;
+    idle.notify_all();
+    not_full.wait(guard, [&]{
+	return closed || (!held && (items.size() < capacity)); });
+    waiting = false;
+    return !closed;
+  }
+
+  // keep the producer in ready, return once it waits there
+  void hold(){
+    unique_lock<mutex> guard(lock);
+    held = true;
+    idle.wait(guard, [&]{ return closed || waiting; });
+  }
+
+  void release(){
+    lock_guard<mutex> guard(lock);
+    held = false;
+    not_full.notify_all();
+  }
+
+  bool push(T item){
+    unique_lock<mutex> guard(lock);
+    not_full.wait(guard, [&]{
+	return closed || (items.size() < capacity); });
+    if (closed) return false;
+    items.push_back(move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T& item){
+    unique_lock<mutex> guard(lock);
+    not_empty.wait(guard, [&]{ return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close(){
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+    idle.notify_all();
+  }
+};
+
+// ******************************************************
+// Prepares training units on a producer thread while the
+//   trainer runs forward and backward. The producer draws
+//   items (documents, batches) in shuffled order,
+//   per_step of them for each unit, and turns their
+//   indices into a unit with make. With bucket > 0, the
+//   items of bucket units are sorted by length before
+//   being cut into units, and the units are shuffled
+//   again, so the items of a unit are about as long as
+//   each other. The shuffles use a generator of the
+//   producer's own, seeded with seed, so processes
+//   seeded alike draw the same units. Units can also
+//   come from a source function instead, until it 
+//   returns false, e.g. for documents read from a 
+//   stream.
+//
+// Start it after any fork(), or pause it around one: only
+//   the forking thread lives on in the child, and must not
+//   fork while the producer is halfway through a unit.
+// ******************************************************
+template <class T>
+class Prefetcher {
+private:
+  struct Prepared {
+    T unit;
+    bool newpass; // a new pass over the data starts here
+  };
+  unsigned nitems, per_step, block, bucket;
+  function<unsigned(unsigned)> length;
+  function<T(const vector<unsigned>&)> make;
+  function<bool(T&)> source;
+  mt19937 rng;
+  BoundedQueue<Prepared> queue;
+  thread producer;
+
+  void produce(){
+    if (source){
+      Prepared p{T(), false};
+      while (queue.ready() && source(p.unit)){
+	if (!queue.push(move(p))) return;
+	p = Prepared{T(), false};
+      }
+      queue.close();
+      return;
+    }
+    vector<unsigned> order(nitems);
+    for (unsigned i = 0; i < nitems; i++) order[i] = i;
+    unsigned si = nitems;
+    unsigned npool = per_step * max(1u, bucket);
+    vector<unsigned> pool, items;
+    while (true){
+      // draw the items of the next units
+      pool.clear();
+      bool newpass = false;
+      while (pool.size() < npool){
+	if (si == nitems){
+	  shuffle_order(order, block, rng);
+	  si = 0; newpass = true;
+	}
+	pool.push_back(order[si++]);
+      }
+      vector<unsigned> steps(npool / per_step);
+      for (unsigned k = 0; k < steps.size(); k++) steps[k] = k;
+      if (bucket > 0){
+	vector<pair<unsigned, unsigned>> keyed;
+	for (auto i : pool) keyed.push_back(make_pair(length(i), i));
+	stable_sort(keyed.begin(), keyed.end(), 
+		    [](const pair<unsigned, unsigned>& a,
+		       const pair<unsigned, unsigned>& b){
+		      return a.first < b.first; });
+	for (unsigned k = 0; k < npool; k++) pool[k] = keyed[k].second;
+	shuffle(steps.begin(), steps.end(), rng);
+      }
+      for (auto k : steps){
+	items.assign(pool.begin() + k * per_step,
+		     pool.begin() + (k + 1) * per_step);
+	if (!queue.ready()) return;
+	Prepared p{make(items), newpass};
+	newpass = false;
+	if (!queue.push(move(p))) return;
+      }
+    }
+  }
+
+public:
+  Prefetcher(unsigned nitems, unsigned per_step, unsigned block,
+	     unsigned bucket, function<unsigned(unsigned)> length,
+	     function<T(const vector<unsigned>&)> make,
+	     unsigned seed, unsigned depth = 64)
+    :nitems(nitems), per_step(max(1u, per_step)), block(block),
+     bucket(bucket), length(length), make(make), rng(seed),
+     queue(depth){
+    if (nitems > 0) producer = thread(&Prefetcher::produce, this);
+    else queue.close();
+  }
+
+  Prefetcher(function<bool(T&)> source, unsigned depth = 64)
+    :nitems(0), per_step(1), block(0), bucket(0), source(source),
+     queue(depth){
+    producer = thread(&Prefetcher::produce, this);
+  }
+
+  ~Prefetcher(){
+    queue.close();
+    if (producer.joinable()) producer.join();
+  }
+
+  // stop the producer before the next unit, and let it
+  //   go on
+  void pause(){ queue.hold(); }
+  void resume(){ queue.release(); }
+
+  // the next unit, and whether a new pass over the data
+  //   starts with it; false if there are no items, or 
+  //   no more from the source
+  bool next(T& unit, bool& newpass){
+    Prepared p;
+    if (!queue.pop(p)) return false;
+    unit = move(p.unit);
+    newpass = p.newpass;
+    return true;
+  }
+};
+
+#endif
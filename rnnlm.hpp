@@ -2,12 +2,13 @@
 #define RNNLM_HPP
 
 #include "util.hpp"
+#include "output-layer.hpp"
 
 template <class Builder>
 class RNNLM{
 private:
   LookupParameters* p_c; // word embeddings VxK1
-  Parameters* p_R; // output layer: VxK2
+  OutputLayer output; // output layer: VxK2
   Parameters* p_R2; // forward context vector: VxK2
   Parameters* p_bias; // bias Vx1
   Parameters* p_context; // default context vector
@@ -17,47 +18,129 @@ public:
   RNNLM();
   RNNLM(Model& model, unsigned nlayers, 
 	unsigned inputdim, unsigned hiddendim, 
-	unsigned vocabsize):builder(nlayers, inputdim, 
-				    hiddendim, &model){
+	unsigned vocabsize, 
+	const WordClasses* classes = nullptr,
+	unsigned rank = 0):builder(nlayers, inputdim, 
+				   hiddendim, &model){
     p_c = model.add_lookup_parameters(vocabsize, {inputdim}); 
     // for hidden output
-    p_R = model.add_parameters({vocabsize, hiddendim});
+    output = OutputLayer(model, vocabsize, hiddendim, classes, rank);
     // for bias
     p_bias = model.add_parameters({vocabsize});
   }
   
-  Expression BuildGraph(const Doc doc, ComputationGraph& cg){
+  // train with a sampled softmax, null for exact training
+  void set_sampler(const UnigramSampler* sampler, unsigned nsamples){
+    output.set_sampler(sampler, nsamples);
+  }
+
+  // self-normalized training and unnormalized scoring
+  void set_selfnorm(float alpha, bool unnormalized = false){
+    output.set_selfnorm(alpha, unnormalized);
+  }
+
+  Expression BuildGraph(const Doc& doc, ComputationGraph& cg){
     // reset RNN builder for new graph
     builder.new_graph(cg);  
+    output.new_graph(cg);
     // define expression
-    Expression i_R = parameter(cg, p_R);
     Expression i_bias = parameter(cg, p_bias);
-    Expression i_x_t, i_h_t, i_y_t, i_err;
+    Expression i_x_t, i_h_t, i_err;
+    vector<Expression> hs;
+    vector<unsigned> targets;
     // -----------------------------------------
     // build CG for the doc
     vector<Expression> errs;
     for (unsigned k = 0; k < doc.size(); k++){
       builder.start_new_sequence();
       // for each sentence in this doc
-      auto sent = doc[k];
+      auto& sent = doc[k];
       unsigned slen = sent.size() - 1;
+      hs.clear(); targets.clear();
       // build RNN for the current sentence
       for (unsigned t = 0; t < slen; t++){
 	// get word representation
 	i_x_t = lookup(cg, p_c, sent[t]);
 	// compute hidden state
 	i_h_t = builder.add_input(i_x_t);
-	// compute prediction
-	i_y_t = (i_R * i_h_t) + i_bias;
-	// get prediction error
-	i_err = pickneglogsoftmax(i_y_t, sent[t+1]);
-	// add back
-	errs.push_back(i_err);
+	hs.push_back(i_h_t);
+	targets.push_back(sent[t+1]);
+      }
+      // get prediction error of the whole sentence
+      i_err = output.neglogprob(hs, i_bias, targets);
+      // add back
+      errs.push_back(i_err);
+    }
+    Expression i_nerr = sum(errs);
+    return i_nerr;
+  }
+
+  Expression BuildBatchGraph(const DocBatch& batch, 
+			     ComputationGraph& cg){
+    // reset RNN builder for new graph
+    builder.new_graph(cg);  
+    output.new_graph(cg);
+    // define expression
+    Expression i_bias = parameter(cg, p_bias);
+    Expression i_x_t, i_h_t, i_err;
+    vector<Expression> hs;
+    // -----------------------------------------
+    // build CG for all lanes, one sentence at a time
+    vector<Expression> errs;
+    for (unsigned k = 0; k < batch.inputs.size(); k++){
+      builder.start_new_sequence();
+      hs.clear();
+      for (unsigned t = 0; t < batch.inputs[k].size(); t++){
+	// get word representations of all lanes
+	i_x_t = lookup(cg, p_c, batch.inputs[k][t]);
+	// compute hidden states
+	i_h_t = builder.add_input(i_x_t);
+	hs.push_back(i_h_t);
       }
+      // get prediction error, ignore padded lanes
+      i_err = output.neglogprob(hs, i_bias, batch.seq_targets[k], 
+				batch.seq_masks[k]);
+      errs.push_back(i_err);
     }
     Expression i_nerr = sum(errs);
     return i_nerr;
   }
+
+  // score with an int8 copy of the output layer, false 
+  //   if it has word classes
+  bool quantizable() const { return output.quantizable(); }
+  bool quantize(){
+    return output.quantize();
+  }
+
+  // loss of a doc with the int8 output layer: the graph
+  //   only computes the projected hidden states, which 
+  //   are scored off the graph (forward only)
+  double QuantizedLoss(const Doc& doc, ComputationGraph& cg){
+    builder.new_graph(cg);
+    output.new_graph(cg);
+    Expression i_x_t, i_h_t;
+    vector<Expression> xs;
+    vector<unsigned> targets;
+    for (unsigned k = 0; k < doc.size(); k++){
+      builder.start_new_sequence();
+      auto& sent = doc[k];
+      unsigned slen = sent.size() - 1;
+      for (unsigned t = 0; t < slen; t++){
+	i_x_t = lookup(cg, p_c, sent[t]);
+	i_h_t = builder.add_input(i_x_t);
+	xs.push_back(output.projection(i_h_t));
+	targets.push_back(sent[t+1]);
+      }
+    }
+    if (xs.empty()) return 0;
+    cg.incremental_forward();
+    double loss = 0;
+    for (unsigned i = 0; i < xs.size(); i++)
+      loss += output.quantized_neglogprob(as_vector(xs[i].value()),
+					  p_bias->values.v, targets[i]);
+    return loss;
+  }
 };
 
 #endif
@@ -6,6 +6,7 @@
 // ********************************************************
 int randomsample(char* fcontext, char* prefix, string flag){
   cnn::Dict d;
+  FastDict fast_dict; // the binary file of the dict
   // ---------------------------------------------
   // predefined variable (will be overwritten after 
   //    loading model)
@@ -28,30 +29,40 @@ int randomsample(char* fcontext, char* prefix, string flag){
     return -1;
   }
   // load dict and freeze it
-  load_dict(fprefix, d);
+  load_dict(fprefix, d, &fast_dict);
+  // samples are written with the words of d
+  if (fast_dict.is_open()) fast_dict.fill(d);
   unsigned vocabsize = d.size();
   cerr << "Vocab size = " << vocabsize << endl;
   d.Freeze();
-  Corpus tst = readData(fcontext, &d, false);
+  WordClasses classes;
+  if (load_classes(fprefix, classes) == 0)
+    cerr << "Number of word classes: " << classes.size() << endl;
+  unsigned rank = load_rank(fprefix);
+  if (rank > 0) cerr << "Rank of the output layer: " << rank << endl;
+  Corpus tst = readData(fcontext, &d, false, 
+			fast_dict.is_open() ? &fast_dict : nullptr);
 
   // ----------------------------------------------
   // define model
-  Model omodel, hmodel, rmodel;
-  // only one of them is used in the following
-  DCLMOutput<LSTMBuilder> olm(omodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  DCLMHidden<LSTMBuilder> hlm(hmodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  RNNLM<LSTMBuilder> rnnlm(rmodel, nlayers, inputdim,
-			   hiddendim, vocabsize);
+  ModelConfig config = {nlayers, inputdim, hiddendim, 0, 
+			vocabsize, &classes, rank};
+  unique_ptr<LanguageModel> lm = make_model(flag, config);
+  if (!lm || !lm->samples()){
+    cerr << "Unrecognized flag: " << flag << endl;
+    return -1;
+  }
   // Load model
   cerr << "Load model from: " << fprefix << ".model" << endl;
-  if (flag == "rnnlm"){
-    load_model(fprefix, rmodel);
-  } else if (flag == "output"){
-    load_model(fprefix, omodel);
-  } else if (flag == "hidden"){
-    load_model(fprefix, hmodel);
+  if (lm->load(fprefix, flag) != 0) return -1;
+  // an int8 model samples with int8 kernels, as far as 
+  //   it can
+  if (model_precision(fprefix) == INT8){
+    if (lm->quantize())
+      cerr << "Sampling with the int8 output layer" << endl;
+    else
+      cerr << "int8 sampling is not supported with word classes,"
+	   << " sampling with the fp32 values of the model" << endl;
   }
 
   // ---------------------------------------------
@@ -61,16 +72,13 @@ int randomsample(char* fcontext, char* prefix, string flag){
   //iterating over documents
   string sent; // generated sentence
   ComputationGraph cg;
-  for (auto& context : tst){
-    context.pop_back(); // remove the last sentence
-    context.back().pop_back(); // remove the last token
-    // get the right model
-    if (flag == "hidden"){
-      sent = hlm.RandomSample(context, cg, d);
-    } else {
-      cerr << "Unrecognized flag: " << flag << endl;
-      return -1;
-    }
+  for (auto& doc : tst){
+    if (doc.size() < 2) continue;
+    // remove the last sentence
+    vector<Sent> sents(doc.begin(), doc.end() - 1);
+    sents.back().pop_back(); // remove the last token
+    Doc context(sents.data(), sents.data() + sents.size());
+    sent = lm->RandomSample(context, cg, d);
     cerr << sent << endl;
     cerr << "===" << endl;    
     myfile << sent << "\n";
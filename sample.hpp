@@ -1,9 +1,7 @@
 #ifndef SAMPLE_HPP
 #define SAMPLE_HPP
 
-#include "dclm-output.hpp"
-#include "dclm-hidden.hpp"
-#include "rnnlm.hpp"
+#include "language-model.hpp"
 #include "util.hpp"
 
 int randomsample(char* fcontext, char* prefix, string flag);
@@ -1,105 +1,215 @@
 #include "test.hpp"
 
 #include <boost/format.hpp>
+#include <chrono>
+
+bool EXACT_SCORING = false;
 
 // ********************************************************
-// test
+// the model of a prefix, with its dict and word classes,
+//   null if it cannot be loaded
 // ********************************************************
-int test(char* ftst, char* prefix, string flag){
-  // ---------------------------------------------
-  // 
-  cnn::Dict d;
-
+static unique_ptr<LanguageModel> load_lm(const string& fprefix, 
+					 const string& flag,
+					 cnn::Dict& d, FastDict& fast_dict,
+					 WordClasses& classes){
   // ---------------------------------------------
   // predefined variable (will be overwritten after 
   //    loading model)
   unsigned nlayers = 2;
   unsigned inputdim = 16, hiddendim = 48;
-  if (flag.size() == 0) flag = "output";
-  // model and dict file name prefix
-  string fprefix = string(prefix);
-  string fout = string(ftst);
-  fout += ("." + flag + ".result");
-  ofstream myfile; myfile.open(fout);
-
   // ---------------------------------------------
   // check model name
   if (fprefix.size() == 0){
     cerr << "Unspecified model name" << endl;
-    return -1;
+    return nullptr;
   }
-  // load dict and freeze it
-  load_dict(fprefix, d);
-  unsigned vocabsize = d.size();
+  // load dict and freeze it; words are looked up in
+  //   the binary dict, if there is one
+  load_dict(fprefix, d, &fast_dict);
+  unsigned vocabsize = fast_dict.is_open() ? fast_dict.size() : d.size();
   cerr << "Vocab size = " << vocabsize << endl;
   d.Freeze();
-  Corpus tst = readData(ftst, &d, false);
+  if (load_classes(fprefix, classes) == 0)
+    cerr << "Number of word classes: " << classes.size() << endl;
+  unsigned rank = load_rank(fprefix);
+  if (rank > 0) cerr << "Rank of the output layer: " << rank << endl;
 
   // ----------------------------------------------
   // define model
-  Model omodel, hmodel, rmodel, smodel, wmodel;
-  // only one of them is used in the following
-  DCLMOutput<LSTMBuilder> olm(omodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  DCLMHidden<LSTMBuilder> hlm(hmodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  RNNLM<LSTMBuilder> rnnlm(rmodel, nlayers, inputdim,
-			   hiddendim, vocabsize);
-  HRNNLM<LSTMBuilder> hrnnlm(smodel, wmodel, nlayers, 
-			     inputdim, hiddendim, vocabsize);
+  ModelConfig config = {nlayers, inputdim, hiddendim, 0, 
+			vocabsize, &classes, rank};
+  unique_ptr<LanguageModel> lm = make_model(flag, config);
+  if (!lm){
+    cerr << "Unrecognized flag" << endl;
+    return nullptr;
+  }
   
   // Load model
   cerr << "Load model from: " << fprefix << ".model" << endl;
-  if (flag == "rnnlm"){
-    load_model(fprefix, rmodel);
-  } else if (flag == "output"){
-    load_model(fprefix, omodel);
-  } else if (flag == "hidden"){
-    load_model(fprefix, hmodel);
-  } else if (flag == "hrnnlm"){
-    load_model(fprefix + ".sent", smodel);
-    load_model(fprefix + ".word", wmodel);
-  } else {
-    cerr << "Unrecognized flag" << endl;
-    return -1;
+  if (lm->load(fprefix, flag) != 0) return nullptr;
+  // self-normalized models are scored without log Z, 
+  //   unless asked for exact scores
+  ifstream selfnorm(fprefix + ".selfnorm");
+  if (selfnorm.good() && !EXACT_SCORING){
+    cerr << "Scoring without normalization" << endl;
+    lm->set_selfnorm(0.0, true);
   }
+  return lm;
+}
 
-  // ---------------------------------------------
-  // start testing
+// ********************************************************
+// loss of a corpus and its number of words, with the
+//   perplexity of each document written to out (if any),
+//   with the int8 kernels if quantized
+// ********************************************************
+static double score(LanguageModel& lm, const Corpus& tst, 
+		    unsigned& words, ofstream* out = nullptr,
+		    bool quantized = false){
   double loss = 0, dloss = 0;
-  unsigned words = 0, dwords = 0;
+  unsigned dwords = 0;
+  words = 0;
   //iterating over documents
   for (auto& doc : tst){
-    ComputationGraph cg;
-    // get the right model
-    if (flag == "output"){
-      olm.BuildGraph(doc, cg);
-    } else if (flag == "hidden"){
-      hlm.BuildGraph(doc, cg);
-    } else if (flag == "rnnlm"){
-      rnnlm.BuildGraph(doc, cg);
-    } else if (flag == "hrnnlm"){
-      hrnnlm.BuildSentGraph(doc, cg);
+    if (quantized){
+      dloss = lm.QuantizedLoss(doc);
     } else {
-      cerr << "unrecognized flag " << endl;
-      return -1;
+      ComputationGraph cg;
+      lm.BuildTestGraph(doc, cg);
+      dloss = as_scalar(cg.forward());
     }
-    // run forward and backward for sgd update
-    dloss = as_scalar(cg.forward());
     dwords = 0;
     for (auto& sent : doc) dwords += (sent.size() - 1);
     loss += dloss;
     words += dwords;
+    if (out == nullptr) continue;
     cerr << boost::format("%5.4f") % exp(dloss / dwords)
 	 << endl;
-    myfile << " PPL = " 
-	   << boost::format("%5.4f") % exp(dloss / dwords)
-	   << endl;
+    *out << " PPL = " 
+	 << boost::format("%5.4f") % exp(dloss / dwords)
+	 << endl;
   }
+  return loss;
+}
+
+// words scored per second, since start
+static double throughput(unsigned words, 
+			 chrono::steady_clock::time_point start){
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return words / max(elapsed.count(), 1e-9);
+}
+
+// the models and layers the int8 kernels can score
+static const char* INT8_MODELS = "output, hidden and rnnlm models"
+  " without word classes";
+
+// ********************************************************
+// test
+// ********************************************************
+int test(char* ftst, char* prefix, string flag){
+  cnn::Dict d;
+  FastDict fast_dict; // the binary file of the dict
+  WordClasses classes;
+  if (flag.size() == 0) flag = "output";
+  // model and dict file name prefix
+  string fprefix = string(prefix);
+  string fout = string(ftst);
+  fout += ("." + flag + ".result");
+  ofstream myfile; myfile.open(fout);
+
+  unique_ptr<LanguageModel> lm = load_lm(fprefix, flag, d, fast_dict,
+					 classes);
+  if (!lm) return -1;
+  // an int8 model is scored with int8 kernels, as far
+  //   as it can
+  bool quantized = false;
+  if (model_precision(fprefix) == INT8){
+    quantized = lm->quantize();
+    if (quantized)
+      cerr << "Scoring with the int8 output layer" << endl;
+    else
+      cerr << "int8 scoring is only supported for " << INT8_MODELS
+	   << ", scoring the fp32 values of the model" << endl;
+  }
+  Corpus tst = readData(ftst, &d, false, 
+			fast_dict.is_open() ? &fast_dict : nullptr);
+
+  // ---------------------------------------------
+  // start testing
+  unsigned words = 0;
+  auto start = chrono::steady_clock::now();
+  double loss = score(*lm, tst, words, &myfile, quantized);
+  double wps = throughput(words, start);
   cerr << " E = " 
        << boost::format("%1.4f") % (loss / words) 
        << " PPL = " 
        << boost::format("%5.4f") % exp(loss / words) 
+       << " words/s = " << boost::format("%.1f") % wps
        << endl;
   myfile.close();
+  return 0;
+}
+
+// ********************************************************
+// quantize: save the model of a prefix in int8 under 
+//   prefix.int8 (with its dict, classes and rank) and
+//   report how its perplexity on a test file changes
+// ********************************************************
+int quantize(char* ftst, char* prefix, string flag){
+  cnn::Dict d;
+  FastDict fast_dict; // the binary file of the dict
+  WordClasses classes;
+  if (flag.size() == 0) flag = "output";
+  string fprefix = string(prefix);
+  unique_ptr<LanguageModel> lm = load_lm(fprefix, flag, d, fast_dict,
+					 classes);
+  if (!lm) return -1;
+  if (!lm->quantizable()){
+    cerr << "int8 scoring is only supported for " << INT8_MODELS
+	 << endl;
+    return -1;
+  }
+  Corpus tst = readData(ftst, &d, false, 
+			fast_dict.is_open() ? &fast_dict : nullptr);
+  unsigned words = 0;
+  auto start = chrono::steady_clock::now();
+  double before = score(*lm, tst, words);
+  double wps = throughput(words, start);
+  // the int8 model is scored as loaded from its file,
+  //   with the int8 kernels where the model has them
+  string qprefix = fprefix + ".int8";
+  cerr << "Save int8 model into: " << qprefix << ".model" << endl;
+  if (lm->save(qprefix, flag, INT8) != 0) return -1;
+  if (fast_dict.is_open()){
+    // d stayed empty, the words are in the binary dict
+    cnn::Dict words;
+    fast_dict.fill(words);
+    save_dict(qprefix, words);
+  } else {
+    save_dict(qprefix, d);
+  }
+  if (classes.size() > 0) save_classes(qprefix, classes);
+  unsigned rank = load_rank(fprefix);
+  if (rank > 0) save_rank(qprefix, rank);
+  ifstream selfnorm(fprefix + ".selfnorm");
+  if (selfnorm.good()){
+    ofstream out(qprefix + ".selfnorm");
+    out << selfnorm.rdbuf();
+  }
+  if (lm->load(qprefix, flag) != 0) return -1;
+  if (!lm->quantize()) return -1;
+  cerr << "Scoring with the int8 output layer" << endl;
+  start = chrono::steady_clock::now();
+  double after = score(*lm, tst, words, nullptr, true);
+  double qwps = throughput(words, start);
+  double ppl = exp(before / words), qppl = exp(after / words);
+  cerr << " PPL = " << boost::format("%5.4f") % ppl
+       << " int8 PPL = " << boost::format("%5.4f") % qppl
+       << " delta = " << boost::format("%+5.4f") % (qppl - ppl)
+       << " (" << boost::format("%+.2f") % (100 * (qppl / ppl - 1))
+       << "%)" << endl;
+  cerr << " words/s = " << boost::format("%.1f") % wps
+       << " int8 words/s = " << boost::format("%.1f") % qwps
+       << " (x" << boost::format("%.2f") % (qwps / wps) << ")" << endl;
+  return 0;
 }
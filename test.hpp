@@ -1,12 +1,16 @@
 #ifndef TEST_HPP
 #define TEST_HPP
 
-#include "dclm-output.hpp"
-#include "dclm-hidden.hpp"
-#include "rnnlm.hpp"
-#include "hrnnlm.hpp"
+#include "language-model.hpp"
 #include "util.hpp"
 
+// normalize over the vocabulary even for self-normalized models
+extern bool EXACT_SCORING;
+
 int test(char* ftst, char* prefix, string flag);
 
+// rewrite a model in int8, reporting its perplexity 
+//   before and after
+int quantize(char* ftst, char* prefix, string flag);
+
 #endif
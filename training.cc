@@ -1,12 +1,39 @@
 #include "training.hpp"
 
 #include <boost/format.hpp>
+#include <sys/stat.h>
 
 // For logging
 #define ELPP_NO_DEFAULT_LOG_FILE
 #include "easylogging++.h"
 INITIALIZE_EASYLOGGINGPP
 
+// one training step, prepared ahead by the loader
+struct TrainUnit {
+  vector<Doc> docs; // this process's share
+  vector<Corpus> streamed; // keeps streamed documents alive
+  unsigned words; // words to predict in docs
+  DocBatch batch; // docs as lanes, for minibatches
+  vector<Doc> pieces; // segments, for a carried context
+};
+
+unsigned BATCH_SIZE = 1;
+unsigned NUM_CLASSES = 0;
+unsigned NUM_SAMPLES = 0;
+float SELF_NORM = 0.0;
+unsigned OUTPUT_RANK = 0;
+unsigned NUM_THREADS = 1;
+unsigned NUM_PROCS = 1;
+unsigned ACCUM_STEPS = 1;
+unsigned SHUFFLE_BLOCK = 0;
+unsigned MIN_COUNT = 0;
+unsigned MAX_VOCAB = 0;
+unsigned TOKEN_BUDGET = 0;
+bool STREAM = false;
+unsigned RESERVOIR = 0;
+string DICT_PREFIX;
+bool CARRY_CONTEXT = false;
+Precision MODEL_PRECISION = FP32;
 
 // ********************************************************
 // train
@@ -24,6 +51,7 @@ int train(char* ftrn, char* fdev, unsigned nlayers,
   // 
   int kSOS, kEOS;
   cnn::Dict d;
+  FastDict fast_dict; // the binary file of a loaded dict
   string MODELPATH("models/");
   string LOGPATH("logs/");
   
@@ -62,24 +90,43 @@ int train(char* ftrn, char* fdev, unsigned nlayers,
 
   // ---------------------------------------------
   // Either create a dict or load one from the model file
+  //   (or --dict); online training needs a frozen dict
   Corpus training, dev;
-  if (fmodel.size() == 0){
+  string fdict = (fmodel.size() > 0) ? fmodel : DICT_PREFIX;
+  if (STREAM && (fdict.size() == 0)){
+    LOG(INFO) << "Online training needs a dict from --dict or a model";
+    return -1;
+  }
+  // every data-parallel process reads the stream on its 
+  //   own, which only works for a regular file
+  struct stat st;
+  if (STREAM && (NUM_PROCS > 1) && 
+      ((stat(ftrn, &st) != 0) || !S_ISREG(st.st_mode))){
+    LOG(INFO) << "Data-parallel online training needs a regular file";
+    return -1;
+  }
+  if (fdict.size() == 0){
     kSOS = d.Convert("<s>"); //Convert is a method of dict
     kEOS = d.Convert("</s>");
     LOG(INFO) << "Create dict from training data ...";
-    // read training data
-    training = readData(ftrn, &d, true);
+    // read training data, rare words become UNK
+    training = readTrainingData(ftrn, &d, MIN_COUNT, MAX_VOCAB);
     // no new word types allowed
     d.Freeze(); 
     // reading dev data
     dev = readData(fdev, &d, false);
   } else {
-    LOG(INFO) << "Load dict from: " << fmodel;
-    ifstream in(fmodel + ".dict");
-    boost::archive::text_iarchive ia(in);
-    ia >> d; d.Freeze(); 
-    training = readData(ftrn, &d, false);
-    dev = readData(fdev, &d, false);
+    LOG(INFO) << "Load dict from: " << fdict;
+    load_dict(fdict, d, &fast_dict);
+    // the dict is saved with the model
+    if (fast_dict.is_open()) fast_dict.fill(d);
+    d.Freeze(); 
+    kSOS = d.Convert("<s>");
+    kEOS = d.Convert("</s>");
+    const FastDict* fast = fast_dict.is_open() ? &fast_dict : nullptr;
+    // streamed documents are read while training
+    if (!STREAM) training = readData(ftrn, &d, false, fast);
+    dev = readData(fdev, &d, false, fast);
   }
   // get dict size
   unsigned vocabsize = d.size();
@@ -87,133 +134,321 @@ int train(char* ftrn, char* fdev, unsigned nlayers,
   // save dict
   save_dict(fname, d);
   LOG(INFO) << "Save dict into: " << fname;
+  // word classes for a factored softmax, either 
+  //   from the model file or binned by frequency
+  //   word counts come from the dev data (plus one) for
+  //   online training
+  vector<unsigned> counts = count_words(STREAM ? dev : training, 
+					vocabsize);
+  if (STREAM) for (auto& c : counts) c ++;
+  WordClasses classes;
+  if ((fdict.size() > 0) && (load_classes(fdict, classes) == 0)){
+    LOG(INFO) << "Load word classes from: " << fdict;
+  } else if (NUM_CLASSES > 0){
+    classes = build_classes(counts, NUM_CLASSES);
+  }
+  if (classes.size() > 0){
+    LOG(INFO) << "Number of word classes: " << classes.size();
+    save_classes(fname, classes);
+  }
+  if ((SELF_NORM > 0) && (classes.size() > 0)){
+    LOG(INFO) << "Self-normalization needs a full softmax";
+    return -1;
+  }
+  // negatives for sampled softmax training
+  UnigramSampler sampler(counts);
+  const UnigramSampler* psampler = nullptr;
+  if (NUM_SAMPLES > 0){
+    LOG(INFO) << "Sampled softmax with " << NUM_SAMPLES << " negatives";
+    psampler = &sampler;
+  }
+  // self-normalized models can be scored without log Z
+  if (SELF_NORM > 0){
+    LOG(INFO) << "Self-normalization penalty: " << SELF_NORM;
+    ofstream out(fname + ".selfnorm");
+    out << SELF_NORM << endl;
+  }
+  // low-rank output layer, the rank of a loaded model wins
+  unsigned rank = OUTPUT_RANK;
+  if (fmodel.size() > 0) rank = load_rank(fmodel);
+  if (rank > 0){
+    LOG(INFO) << "Rank of the output layer: " << rank;
+    save_rank(fname, rank);
+  }
   // segment training doc
   int len_thresh = 5;
-  LOG(INFO) << "Length threshold: " << len_thresh;
-  training = segment_doc(training, len_thresh);
-  LOG(INFO) << "New training set size: " << training.size();
+  Corpus segments;
+  if (TOKEN_BUDGET > 0){
+    LOG(INFO) << "Token budget: " << TOKEN_BUDGET;
+    if (!STREAM) segments = pack_doc(training, TOKEN_BUDGET);
+  } else {
+    LOG(INFO) << "Length threshold: " << len_thresh;
+    if (!STREAM) segments = segment_doc(training, len_thresh);
+  }
+  if (!STREAM)
+    LOG(INFO) << "New training set size: " << segments.size();
+  // with a carried context, whole documents are shuffled
+  //   and trained segment by segment
+  if (!CARRY_CONTEXT) training = segments;
+  auto segment = [&](const Doc& doc){
+    if (TOKEN_BUDGET > 0) return pack_doc(doc, TOKEN_BUDGET);
+    return segment_doc(doc, len_thresh);
+  };
 
   // ----------------------------------------------
-  // define model
-  Model omodel, hmodel, rmodel, smodel, wmodel;
-  // only one of them is used in the following
-  DCLMOutput<LSTMBuilder> olm(omodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  DCLMHidden<LSTMBuilder> hlm(hmodel, nlayers, inputdim, 
-			      hiddendim, vocabsize);
-  RNNLM<LSTMBuilder> rnnlm(rmodel, nlayers, inputdim,
-			   hiddendim, vocabsize);
-  HRNNLM<LSTMBuilder> hrnnlm(smodel, wmodel, nlayers, 
-			     inputdim,
-			     hiddendim, vocabsize);
+  // define model, only the one that is trained
+  ModelConfig config = {nlayers, inputdim, hiddendim, 0, 
+			vocabsize, &classes, rank};
+  unique_ptr<LanguageModel> lm = make_model(flag, config);
+  if (!lm){
+    LOG(INFO) << "Unrecognized flag";
+    return -1;    
+  }
   // Load model
   if (fmodel.size() > 0){
     LOG(INFO) << "Load model from: " << fmodel;
-    if (flag == "rnnlm"){
-      load_model(fprefix, rmodel);
-    } else if (flag == "output"){
-      load_model(fprefix, omodel);
-    } else if (flag == "hidden"){
-      load_model(fprefix, hmodel);
-    } else if (flag == "hrnnlm"){
-      LOG(INFO) << "Cannot handle this case now ...";
-      return -1;
-    }
+    if (lm->load(fprefix, flag) != 0) return -1;
   } else {
     LOG(INFO) << "Randomly initializing model parameters ...";
   }
-  // define learner
-  Trainer* sgd = nullptr;
-  Trainer* sgd2 = nullptr; // only for hrnnlm
-  if (flag == "rnnlm"){
-    sgd = new SimpleSGDTrainer(&rmodel, 1e-6, lr0); 
-  } else if (flag == "output") {
-    sgd = new SimpleSGDTrainer(&omodel, 1e-6, lr0);     
-  } else if (flag == "hidden") {
-    sgd = new SimpleSGDTrainer(&hmodel, 1e-6, lr0);     
-  } else if (flag == "hrnnlm") { 
-    sgd = new SimpleSGDTrainer(&smodel, 1e-6, lr0);
-    sgd2 = new SimpleSGDTrainer(&wmodel, 1e-6, lr0);    
-  } else {
-    LOG(INFO) << "Unrecognized flag";
-    return -1;    
+  // models being trained, one learner for each
+  vector<Model*> models = lm->models();
+  vector<Trainer*> trainers;
+  for (auto m : models) 
+    trainers.push_back(new SimpleSGDTrainer(m, 1e-6, lr0));
+  if (BATCH_SIZE == 0) BATCH_SIZE = 1;
+  if ((BATCH_SIZE > 1) && !lm->batched()){
+    LOG(INFO) << "Minibatch training is not supported for " << flag;
+    return -1;
   }
+  LOG(INFO) << "Batch size: " << BATCH_SIZE;
+  if (CARRY_CONTEXT){
+    if (!lm->carries_context()){
+      LOG(INFO) << "No context to carry for " << flag;
+      return -1;
+    }
+    // segment counts differ between documents, so lanes 
+    //   and processes would fall out of step
+    if ((BATCH_SIZE > 1) || (NUM_PROCS > 1)){
+      LOG(INFO) << "Carried context needs one document per step";
+      return -1;
+    }
+    LOG(INFO) << "Carry the context across segments";
+  }
+  if (NUM_THREADS == 0) NUM_THREADS = 1;
+  if (NUM_PROCS == 0) NUM_PROCS = 1;
+  if ((NUM_THREADS > 1) && (NUM_PROCS > 1)){
+    LOG(INFO) << "Use either hogwild workers or data-parallel processes";
+    return -1;
+  }
+  // hogwild workers update the models in shared memory
+  LOG(INFO) << "Training workers: " << NUM_THREADS;
+  if (NUM_THREADS > 1)
+    for (auto m : models) share_model(*m);
+  Hogwild hogwild(NUM_THREADS);
+  // data-parallel processes keep their own copies of the
+  //   models, and all of them shuffle the same way
+  LOG(INFO) << "Data-parallel processes: " << NUM_PROCS;
+  DataParallel replicas(NUM_PROCS, models);
+  unsigned seed = (*rndeng)();
+  unsigned proc = replicas.start();
+  // deferred updates on accumulated gradients
+  if (ACCUM_STEPS == 0) ACCUM_STEPS = 1;
+  LOG(INFO) << "Documents per update: " << ACCUM_STEPS * BATCH_SIZE;
+  if (ACCUM_STEPS > 1)
+    for (auto sgd : trainers) accumulate_updates(sgd, ACCUM_STEPS);
+  unsigned nsteps = 0;
+  // apply the gradients summed since the last update, 
+  //   if any
+  auto flush = [&](){
+    if (nsteps % ACCUM_STEPS == 0) return;
+    for (auto sgd : trainers){
+      replicas.sum_gradients(*sgd->model);
+      sgd->update(1.0 / ACCUM_STEPS);
+    }
+    nsteps += ACCUM_STEPS - nsteps % ACCUM_STEPS;
+  };
     
   // ---------------------------------------------
-  // define the indices so we can shuffle the docs
-  vector<unsigned> order(training.size());
-  for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
-  bool first = true; int report = 0; unsigned lines = 0;
+  // units are shuffled, cut and counted on a producer 
+  //   thread; minibatches get documents of similar length
+  auto length = [&](unsigned i){
+    unsigned n = 0;
+    for (auto& sent : training[i]) n += sent.size();
+    return n;
+  };
+  // the documents of all processes in, this process's 
+  //   share ready for training out
+  auto finish = [&](TrainUnit& unit){
+    // each process takes its own share
+    unit.docs = vector<Doc>(unit.docs.begin() + proc * BATCH_SIZE,
+			    unit.docs.begin() + (proc + 1) * BATCH_SIZE);
+    // get how many words in these documents
+    unit.words = 0;
+    vector<const Doc*> docs;
+    for (auto& doc : unit.docs){
+      docs.push_back(&doc);
+      for (auto& sent : doc) 
+	unit.words += (sent.size() - 1);
+    }
+    if (BATCH_SIZE > 1) unit.batch = make_batch(docs, kEOS);
+    if (CARRY_CONTEXT) unit.pieces = segment(unit.docs[0]);
+  };
+  auto make = [&](const vector<unsigned>& items){
+    TrainUnit unit;
+    for (auto i : items) unit.docs.push_back(training[i]);
+    finish(unit);
+    return unit;
+  };
+  // online training: documents are read while training,
+  //   and cut into segments as they come
+  unique_ptr<DocStream> stream;
+  unique_ptr<Reservoir> reservoir;
+  deque<pair<Corpus, Doc>> pending;
+  auto source = [&](TrainUnit& unit){
+    while (unit.docs.size() < BATCH_SIZE * NUM_PROCS){
+      if (pending.empty()){
+	Corpus doc;
+	if (!reservoir->next(doc)) return false;
+	if (CARRY_CONTEXT) pending.push_back(make_pair(doc, doc[0]));
+	else for (auto& piece : segment(doc[0]))
+	       pending.push_back(make_pair(doc, piece));
+      }
+      unit.streamed.push_back(pending.front().first);
+      unit.docs.push_back(pending.front().second);
+      pending.pop_front();
+    }
+    finish(unit);
+    return true;
+  };
+  unsigned bucket = (BATCH_SIZE > 1) ? 16 : 0;
+  unique_ptr<Prefetcher<TrainUnit>> loader;
+  if (STREAM){
+    LOG(INFO) << "Online training, shuffle buffer of " << RESERVOIR 
+	      << " documents";
+    stream.reset(new DocStream(ftrn, &d, fast_dict.is_open() ? 
+			       &fast_dict : nullptr));
+    if (!stream->good()){
+      LOG(INFO) << "Cannot read " << ftrn;
+      return -1;
+    }
+    reservoir.reset(new Reservoir(*stream, RESERVOIR, seed));
+    loader.reset(new Prefetcher<TrainUnit>(source));
+  } else {
+    loader.reset(new Prefetcher<TrainUnit>(training.size(), 
+					   BATCH_SIZE * NUM_PROCS,
+					   SHUFFLE_BLOCK, bucket, 
+					   length, make, seed));
+  }
+  bool first = true, done = false; 
+  int report = 0; unsigned lines = 0;
 
   // ---------------------------------------------
   // start training
-  unsigned si = training.size();
   while(true) {
     // Timer iteration("completed in");
     double dloss = 0, loss = 0;
-    unsigned words = 0, dwords = 0;
+    unsigned words = 0;
+    // train with sampled softmax, if asked for
+    lm->set_sampler(psampler, NUM_SAMPLES);
+    lm->set_selfnorm(SELF_NORM);
+    // gradients are summed over all processes first, and
+    //   over ACCUM_STEPS steps before each update; a 
+    //   process with nothing learned still has to keep 
+    //   in step with the others
+    auto update = [&](unsigned k, bool learned){
+      if (!learned && (NUM_PROCS <= 1)) return;
+      if (nsteps % ACCUM_STEPS != 0) return;
+      replicas.sum_gradients(*trainers[k]->model);
+      trainers[k]->update(1.0 / ACCUM_STEPS);
+    };
+    // one update on a set of documents, return the loss
+    auto train_step = [&](const TrainUnit& unit) -> double {
+      double dloss = 0;
+      nsteps ++;
+      if (CARRY_CONTEXT){
+	// truncated BPTT: one graph and update per segment, 
+	//   the final context vector goes into the next 
+	//   segment as a constant
+	auto& pieces = unit.pieces;
+	vector<float> context;
+	for (unsigned k = 0; k < pieces.size(); k++){
+	  if (k > 0) nsteps ++;
+	  ComputationGraph cg;
+	  const vector<float>* carry = (k > 0) ? &context : nullptr;
+	  lm->BuildGraph(pieces[k], cg, carry);
+	  dloss += as_scalar(cg.forward());
+	  cg.backward();
+	  update(0, true);
+	  context = lm->final_context();
+	}
+	return dloss;
+      }
+      if (BATCH_SIZE > 1){
+	// run all documents as parallel lanes
+	ComputationGraph cg;
+	lm->BuildBatchGraph(unit.batch, cg);
+	dloss = as_scalar(cg.forward());
+	cg.backward(); 
+	update(0, true);
+	return dloss;
+      }
+      // one document, forward and backward for sgd update
+      return lm->TrainGraph(unit.docs[0], update);
+    };
     //iterating over documents
+    vector<TrainUnit> steps;
     for (unsigned i = 0; i < report_every_i; ++i) { 
-      //check if it's the number of documents
-      if (si == training.size()) { 
-        si = 0;
-        if (first) { 
+      // get the next BATCH_SIZE documents
+      TrainUnit unit;
+      bool newpass;
+      if (!loader->next(unit, newpass)){
+	if (!STREAM){
+	  LOG(INFO) << "No training documents";
+	  return -1;
+	}
+	done = true;
+	break;
+      }
+      if (newpass) { 
+	if (first) { 
 	  first = false; 
 	} else { 
-	  sgd->update_epoch(); 
-	  if (flag == "hrnnlm")
-	    sgd2->update_epoch();
+	  for (auto sgd : trainers) sgd->update_epoch(); 
 	}
-	cout << "==SHUFFLE==" << endl;
-        shuffle(order.begin(), order.end(), *rndeng);
+	if (proc == 0) cout << "==SHUFFLE==" << endl;
       }
-      // get one document
-      auto& doc = training[order[si]];
-      // get how many words in this documents
-      dwords = 0;
-      for (auto& sent : doc) 
-	dwords += (sent.size() - 1);
-      ComputationGraph cg;
-      // get the right model
-      if (flag == "rnnlm"){
-	rnnlm.BuildGraph(doc, cg);
-      } else if (flag == "output") {
-	olm.BuildGraph(doc, cg);	
-      } else if (flag == "hidden") {
-	hlm.BuildGraph(doc, cg);	
-      } else if (flag == "hrnnlm") {
-	// stensor.clear();
-	if (doc.size() > 1){
-	  // ignore, if only has one sentence
-	  hrnnlm.BuildSentGraph(doc, cg); 
-	}
+      words += unit.words;
+      // run now, or leave it to the workers
+      if (NUM_THREADS > 1) steps.push_back(move(unit));
+      else loss += train_step(unit);
+    }
+    if (NUM_THREADS > 1){
+      // lock-free updates from all workers at once, with
+      //   the producer stopped while they are forked
+      auto step = [&](unsigned k){ return train_step(steps[k]); };
+      loader->pause();
+      int ret = hogwild.run(steps.size(), step, dloss, flush);
+      loader->resume();
+      if (ret < 0){
+	LOG(INFO) << "A training worker failed";
+	return -1;
       }
-      // run forward and backward for sgd update
-      if ((flag != "hrnnlm") || (doc.size() > 1)){
-	// ignore, if it is hrnnlm and doc only 
-	//   has one sentence
-	dloss = as_scalar(cg.forward());
-	cg.backward(); 
-	sgd->update();
-      } 
-      // else {
-      // 	cout << "flag = " << flag 
-      // 	     << " doc.size = " << doc.size() << endl;
-      // }
-      if (flag == "hrnnlm"){
-      	// update word-level LM for hrnnlm
-      	hrnnlm.BuildWordGraph(doc, cg);
-	// update dloss
-	dloss = as_scalar(cg.forward());
-	// backward and update
-      	cg.backward(); 
-	sgd2->update();
-      } 
-      loss += dloss; words += dwords;
-      si ++;
+      loss += dloss;
+    }
+    // the last update of the stream may be incomplete
+    if (done) flush();
+    // totals over all processes, only rank 0 reports
+    loss = replicas.sum(loss);
+    words = replicas.sum(words);
+    if (done && (proc == 0))
+      LOG(INFO) << "End of the training stream after " 
+		<< stream->count() << " documents";
+    if (proc > 0){
+      if (done) break;
+      continue;
     }
-    sgd->status();
-    if (flag == "hrnnlm") { sgd2->status(); }
+    for (auto sgd : trainers) sgd->status();
     LOG(INFO) << " E = " 
 	      << boost::format("%1.4f") % (loss / words) 
 	      << " PPL = " 
@@ -222,36 +457,39 @@ int train(char* ftrn, char* fdev, unsigned nlayers,
     
     // ----------------------------------------
     report++;
-    if (report % dev_every_i_reports == 0) {
+    if ((report % dev_every_i_reports == 0) || done) {
       double dloss = 0;
       int dwords = 0, docctr = 0;
-      for (auto& doc : dev){
+      // dev perplexity is always exact
+      lm->set_sampler(nullptr, 0);
+      lm->set_selfnorm(0.0);
+      for (unsigned j = 0; (BATCH_SIZE > 1) && (j < dev.size()); 
+	   j += BATCH_SIZE){
+	// evaluate dev documents in minibatches
+	vector<const Doc*> docs;
+	for (unsigned b = j; (b < j + BATCH_SIZE) && (b < dev.size()); b++)
+	  docs.push_back(&dev[b]);
+	DocBatch batch = make_batch(docs, kEOS);
+	ComputationGraph cg;
+	lm->BuildBatchGraph(batch, cg);
+	dloss += as_scalar(cg.forward());
+	for (auto dp : docs)
+	  for (auto& sent : *dp) dwords += sent.size() - 1;
+      }
+      for (unsigned j = 0; (BATCH_SIZE == 1) && (j < dev.size()); j++){
+	auto& doc = dev[j];
 	// for each doc
 	ComputationGraph cg;
-	// get the right model
-	if (flag == "output") {
-	  olm.BuildGraph(doc, cg);
-	} else if (flag == "hidden") {
-	  hlm.BuildGraph(doc, cg);
-	} else if (flag == "rnnlm") {
-	  rnnlm.BuildGraph(doc, cg);
-	} else if (flag == "hrnnlm") {
-	  // for compute stensor
-	  if (doc.size() > 1){
-	    hrnnlm.BuildSentGraph(doc, cg);
-	    cg.forward();
-	  }
-	  // build graph on word-level LM
-	  hrnnlm.BuildWordGraph(doc, cg);
-	  // get word-level loss from the 
-	  //   next forward
-	}
+	lm->BuildGraph(doc, cg);
 	dloss += as_scalar(cg.forward());
 	for (auto& sent : doc) dwords += sent.size() - 1;
       }
-      // print PPL on dev
-      LOG(INFO) << "DEV[epoch=" 
-		<< (lines / (double)training.size()) 
+      // print PPL on dev; a stream has no epochs, only
+      //   the documents read so far
+      ostringstream pos;
+      if (STREAM) pos << "docs=" << stream->count();
+      else pos << "epoch=" << (lines / (double)training.size());
+      LOG(INFO) << "DEV[" << pos.str() 
 		<< "] E = "
 		<< boost::format("%1.4f") % (dloss / dwords) 
 		<< " PPL = " 
@@ -263,19 +501,12 @@ int train(char* ftrn, char* fdev, unsigned nlayers,
       if (dloss < best) {
 	best = dloss;
 	LOG(INFO) << "Save model into: "<<fname;
-	if (flag == "rnnlm"){
-	  save_model(fname, rmodel);
-	} else if (flag == "output"){
-	  save_model(fname, omodel);
-	} else if (flag == "hidden"){
-	  save_model(fname, hmodel);
-	} else if (flag == "hrnnlm"){
-	  save_model(fname + ".sent", smodel);
-	  save_model(fname + ".word", wmodel);
-	}
+	lm->save(fname, flag, MODEL_PRECISION);
       }
     }
     // end dev
+    if (done) break;
   }
-  delete sgd, sgd2;
+  for (auto sgd : trainers) delete sgd;
+  return 0;
 }
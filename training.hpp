@@ -1,11 +1,51 @@
 #ifndef TRAINING_HPP
 #define TRAINING_HPP
 
-#include "dclm-output.hpp"
-#include "dclm-hidden.hpp"
-#include "rnnlm.hpp"
-#include "hrnnlm.hpp"
+#include "language-model.hpp"
 #include "util.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
+
+// number of documents trained together in one graph
+extern unsigned BATCH_SIZE;
+// number of word classes, 0 for a full softmax
+extern unsigned NUM_CLASSES;
+// number of negatives for sampled softmax training, 
+//   0 for a full softmax
+extern unsigned NUM_SAMPLES;
+// weight of the self-normalization penalty, 0 for none
+extern float SELF_NORM;
+// rank of a factored output layer, 0 for a full matrix
+extern unsigned OUTPUT_RANK;
+// number of hogwild training workers
+extern unsigned NUM_THREADS;
+// number of synchronous data-parallel processes
+extern unsigned NUM_PROCS;
+// number of steps whose gradients are summed before
+//   each update
+extern unsigned ACCUM_STEPS;
+// documents per shuffling block, 0 for a full shuffle
+extern unsigned SHUFFLE_BLOCK;
+// vocabulary cutoff: minimum count of a word and most
+//   words in the dict, 0 for no limit
+extern unsigned MIN_COUNT;
+extern unsigned MAX_VOCAB;
+// most tokens in a training unit, 0 to cut documents
+//   into pieces of 6 sentences instead
+extern unsigned TOKEN_BUDGET;
+// train each document segment by segment, carrying the 
+//   context vector from one segment into the next
+extern bool CARRY_CONTEXT;
+// online training: read the training file as a stream
+//   (a FIFO, or - for stdin), shuffled through a buffer
+//   of so many documents (0 to train in stream order),
+//   against the dict of a model or of the DICT_PREFIX 
+//   files
+extern bool STREAM;
+extern unsigned RESERVOIR;
+extern string DICT_PREFIX;
+// precision of saved models; training itself keeps fp32
+extern Precision MODEL_PRECISION;
 
 int train(char* ftrn, char* fdev, unsigned nlayers = 2, 
 	  unsigned inputdim = 16, unsigned hiddendim = 48, 
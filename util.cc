@@ -1,30 +1,823 @@
 #include "util.hpp"
 
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DCLM_X86
+#endif
+
 // *******************************************************
-// load model from a archive file
+// Binary model file: a header, one table entry for each 
+//   parameter (dense ones first, then lookup tables, in 
+//   the order the model created them), and the raw values
+//   of every parameter (fp32, 16-bit floats, or int8 with
+//   a scale per row), each parameter aligned to 64 
+//   bytes. Models saved before are text archives, which 
+//   load_model still reads.
 // *******************************************************
-int load_model(string fname, Model& model){
-  ifstream in(fname + ".model");
-  boost::archive::text_iarchive ia(in);
-  ia >> model;
+struct ModelHeader {
+  char magic[8];
+  uint32_t version, nparams, nlookups;
+  uint32_t precision; // of the values: FP32, FP16, BF16, INT8
+  uint64_t vocab; // most rows of a lookup table
+  char type[32]; // e.g. "output", "dam", empty if unknown
+};
+
+struct ModelEntry {
+  uint32_t nd, d[7]; // dimensions of the parameter, or row
+  uint64_t rows; // rows of a lookup table, 1 for dense
+  uint64_t offset; // of the values from the file start
+};
+
+static const char MODEL_MAGIC[8] = {'D','C','L','M','M','D','L','B'};
+static const uint32_t MODEL_VERSION = 1;
+
+int parse_precision(const string& name){
+  if (name == "fp32") return FP32;
+  if (name == "fp16") return FP16;
+  if (name == "bf16") return BF16;
+  if (name == "int8") return INT8;
+  return -1;
+}
+
+// *******************************************************
+// 16-bit floats, rounded to the nearest even: fp16 keeps
+//   10 bits of mantissa up to 65504, bf16 keeps the range
+//   of fp32 with 7 bits of mantissa
+// *******************************************************
+static inline uint32_t float_bits(float f){
+  uint32_t u; memcpy(&u, &f, 4); return u;
+}
+
+static inline float bits_float(uint32_t u){
+  float f; memcpy(&f, &u, 4); return f;
+}
+
+static inline uint16_t to_fp16(float f){
+  uint32_t u = float_bits(f);
+  uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+  uint16_t h;
+  if (u >= (143u << 23)){ 
+    // too large, infinity or NaN
+    h = (u > (255u << 23)) ? 0x7e00 : 0x7c00;
+  } else if (u < (113u << 23)){
+    // subnormal or zero, rounded by the float addition
+    const float magic = bits_float(126u << 23);
+    h = float_bits(bits_float(u) + magic) - float_bits(magic);
+  } else {
+    uint32_t odd = (u >> 13) & 1;
+    u += (uint32_t)(15 - 127) * (1u << 23) + 0xfff + odd;
+    h = u >> 13;
+  }
+  return h | (sign >> 16);
+}
+
+static inline float from_fp16(uint16_t h){
+  const uint32_t exp = 0x7c00u << 13;
+  uint32_t u = ((uint32_t)h & 0x7fff) << 13;
+  uint32_t e = u & exp;
+  u += (127 - 15) << 23;
+  if (e == exp){
+    // infinity or NaN
+    u += (128 - 16) << 23;
+  } else if (e == 0){
+    // subnormal or zero
+    u += 1 << 23;
+    u = float_bits(bits_float(u) - bits_float(113u << 23));
+  }
+  return bits_float(u | ((uint32_t)(h & 0x8000) << 16));
+}
+
+static inline uint16_t to_bf16(float f){
+  uint32_t u = float_bits(f);
+  if ((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40;
+  return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+static inline float from_bf16(uint16_t h){
+  return bits_float((uint32_t)h << 16);
+}
+
+#ifdef DCLM_X86
+// fp16 conversions eight at a time with F16C, chosen at 
+//   run time, so the build needs no -mf16c; they return
+//   how many values they converted
+static bool has_f16c(){
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+}
+
+__attribute__((target("avx,f16c")))
+static size_t widen_f16c(const uint16_t* in, float* out, size_t n){
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+  return i;
+}
+
+__attribute__((target("avx,f16c")))
+static size_t narrow_f16c(const float* in, uint16_t* out, size_t n){
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), 
+		     _mm256_cvtps_ph(_mm256_loadu_ps(in + i), 
+				     _MM_FROUND_TO_NEAREST_INT));
+  return i;
+}
+#endif
+
+// 16-bit values to fp32
+static void widen(const uint16_t* in, float* out, size_t n, 
+		  unsigned precision){
+  size_t i = 0;
+  if (precision == BF16){
+    for (; i < n; i++) out[i] = from_bf16(in[i]);
+    return;
+  }
+#ifdef DCLM_X86
+  if (has_f16c()) i = widen_f16c(in, out, n);
+#endif
+  for (; i < n; i++) out[i] = from_fp16(in[i]);
+}
+
+// fp32 values to 16-bit ones
+static void narrow(const float* in, uint16_t* out, size_t n, 
+		   unsigned precision){
+  size_t i = 0;
+  if (precision == BF16){
+    for (; i < n; i++) out[i] = to_bf16(in[i]);
+    return;
+  }
+#ifdef DCLM_X86
+  if (has_f16c()) i = narrow_f16c(in, out, n);
+#endif
+  for (; i < n; i++) out[i] = to_fp16(in[i]);
+}
+
+// *******************************************************
+// int8 values with a scale per row: row i of a column-
+//   major matrix of r rows holds v[i], v[i+r], ..., 
+//   quantized symmetrically into [-127, 127]
+// *******************************************************
+static void quantize_rows(const float* v, size_t n, unsigned r,
+			  float* scales, int8_t* q){
+  for (unsigned i = 0; i < r; i++) scales[i] = 0;
+  for (size_t j = 0; j < n; j += r)
+    for (unsigned i = 0; i < r; i++)
+      scales[i] = max(scales[i], fabs(v[j + i]));
+  for (unsigned i = 0; i < r; i++) scales[i] /= 127;
+  for (size_t j = 0; j < n; j += r)
+    for (unsigned i = 0; i < r; i++)
+      q[j + i] = (scales[i] > 0) ? lrintf(v[j + i] / scales[i]) : 0;
+}
+
+static void dequantize_rows(const int8_t* q, const float* scales, 
+			    size_t n, unsigned r, float* v){
+  for (size_t j = 0; j < n; j += r)
+    for (unsigned i = 0; i < r; i++)
+      v[j + i] = q[j + i] * scales[i];
+}
+
+#ifdef DCLM_X86
+// dot product of int8 vectors in int32, 32 values at a
+//   time with AVX2 (|a| times b with the sign of a, 
+//   which cannot overflow the pairs of int16 in between);
+//   chosen at run time like the F16C conversions
+static bool has_avx2(){
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_int8_avx2(const int8_t* a, const int8_t* b, size_t n){
+  size_t i = 0;
+  __m256i acc = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  for (; i + 32 <= n; i += 32){
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    __m256i p = _mm256_maddubs_epi16(_mm256_abs_epi8(va), 
+				     _mm256_sign_epi8(vb, va));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+			    _mm256_extracti128_si256(acc, 1));
+  // 16 more values with SSE, e.g. the tail of 48 ones
+  if (i + 16 <= n){
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    __m128i p = _mm_maddubs_epi16(_mm_abs_epi8(va), _mm_sign_epi8(vb, va));
+    s = _mm_add_epi32(s, _mm_madd_epi16(p, _mm_set1_epi16(1)));
+    i += 16;
+  }
+  s = _mm_hadd_epi32(s, s);
+  s = _mm_hadd_epi32(s, s);
+  int32_t sum = _mm_cvtsi128_si32(s);
+  for (; i < n; i++) sum += (int32_t)a[i] * b[i];
+  return sum;
+}
+#endif
+
+// dot product of int8 vectors in int32
+static int32_t dot_int8(const int8_t* a, const int8_t* b, size_t n){
+  int32_t sum = 0;
+  for (size_t i = 0; i < n; i++) sum += (int32_t)a[i] * b[i];
+  return sum;
+}
+
+void QuantizedMatrix::quantize(const float* m, unsigned rows, 
+			       unsigned cols){
+  nrows = rows; ncols = cols;
+  scales.resize(rows);
+  vector<int8_t> q(rows * cols);
+  quantize_rows(m, q.size(), rows, scales.data(), q.data());
+  // row by row, for the dot products
+  values.resize(q.size());
+  for (unsigned i = 0; i < rows; i++)
+    for (unsigned j = 0; j < cols; j++)
+      values[i * cols + j] = q[j * rows + i];
+  qx.resize(cols);
+  dot = dot_int8;
+#ifdef DCLM_X86
+  if (has_avx2()) dot = dot_int8_avx2;
+#endif
+}
+
+void QuantizedMatrix::quantize_input(const float* x) const {
+  quantize_rows(x, ncols, 1, &sx, qx.data());
+}
+
+void QuantizedMatrix::multiply(const float* x, float* y, 
+			       const float* bias) const {
+  quantize_input(x);
+  for (unsigned i = 0; i < nrows; i++){
+    y[i] = dot(&values[i * ncols], qx.data(), ncols) * scales[i] * sx;
+    if (bias != nullptr) y[i] += bias[i];
+  }
+}
+
+float QuantizedMatrix::multiply_row(unsigned i, const float* x) const {
+  quantize_input(x);
+  return dot(&values[i * ncols], qx.data(), ncols) * scales[i] * sx;
+}
+
+void release_values(float* v, size_t n){
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(v) + page - 1) & ~(page - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(v + n) & ~(page - 1);
+  if (end > begin)
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
+
+// *******************************************************
+// Parameters are stored in blocks: a dense parameter is
+//   one block, a lookup table one block per row. An int8
+//   block starts with its scales: one per row of a 
+//   matrix, or one for a vector.
+// *******************************************************
+static uint64_t block_values(const ModelEntry& e){
+  uint64_t n = 1;
+  for (unsigned i = 0; i < e.nd; i++) n *= e.d[i];
+  return n;
+}
+
+static unsigned block_scales(const ModelEntry& e){
+  return (e.nd >= 2) ? e.d[0] : 1;
+}
+
+static uint64_t block_bytes(const ModelEntry& e, unsigned precision){
+  uint64_t n = block_values(e);
+  if (precision == FP32) return n * sizeof(float);
+  if (precision == INT8) return block_scales(e) * sizeof(float) + n;
+  return n * sizeof(uint16_t);
+}
+
+// fp32 values of a block
+static void read_block(const char* in, float* out, const ModelEntry& e,
+		       unsigned precision){
+  size_t n = block_values(e);
+  if (precision == FP32){
+    memcpy(out, in, n * sizeof(float));
+  } else if (precision == INT8){
+    // scales are not aligned after a row of int8 values
+    vector<float> scales(block_scales(e));
+    memcpy(scales.data(), in, scales.size() * sizeof(float));
+    dequantize_rows(reinterpret_cast<const int8_t*>(in) 
+		    + scales.size() * sizeof(float),
+		    scales.data(), n, scales.size(), out);
+  } else {
+    widen(reinterpret_cast<const uint16_t*>(in), out, n, precision);
+  }
+}
+
+static ModelEntry model_entry(const Dim& dim, uint64_t rows){
+  ModelEntry e;
+  memset(&e, 0, sizeof(e));
+  e.nd = dim.nd;
+  for (unsigned i = 0; (i < dim.nd) && (i < 7); i++) e.d[i] = dim.d[i];
+  e.rows = rows;
+  return e;
+}
+
+// offsets of the values of table entries, return the 
+//   size of the file
+static uint64_t layout_table(vector<ModelEntry>& table, 
+			     unsigned precision){
+  uint64_t bytes = sizeof(ModelHeader) + table.size() * sizeof(ModelEntry);
+  for (auto& e : table){
+    bytes = (bytes + 63) / 64 * 64;
+    e.offset = bytes;
+    bytes += e.rows * block_bytes(e, precision);
+  }
+  return bytes;
+}
+
+// table entries of a model, with the offsets of its 
+//   values in a file of the given precision
+static vector<ModelEntry> model_table(Model& model, uint64_t& bytes,
+				      unsigned precision = FP32){
+  vector<ModelEntry> table;
+  for (auto p : model.parameters_list())
+    table.push_back(model_entry(p->dim, 1));
+  for (auto p : model.lookup_parameters_list())
+    table.push_back(model_entry(p->dim, p->values.size()));
+  bytes = layout_table(table, precision);
+  return table;
+}
+
+// *******************************************************
+// load model from a binary file, or from an old text 
+//   archive. An fp32 file is mapped into memory and used
+//   in place (pages are copied only when training 
+//   changes them), a 16-bit or int8 one is widened into
+//   the parameters, so it saves disk and reading only.
+// *******************************************************
+int load_model(string fname, Model& model, const string& type){
+  fname += ".model";
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0){
+    cerr << "Cannot open " << fname << endl;
+    return -1;
+  }
+  struct stat st;
+  char magic[8] = {0};
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(ModelHeader))
+      || (pread(fd, magic, 8, 0) != 8) 
+      || (memcmp(magic, MODEL_MAGIC, 8) != 0)){
+    close(fd);
+    ifstream in(fname);
+    boost::archive::text_iarchive ia(in);
+    ia >> model;
+    return 0;
+  }
+  void* mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, 
+		   MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    cerr << "Cannot map " << fname << endl;
+    return -1;
+  }
+  char* base = static_cast<char*>(mem);
+  const ModelHeader* h = static_cast<const ModelHeader*>(mem);
+  uint64_t bytes;
+  vector<ModelEntry> want = model_table(model, bytes, h->precision);
+  const ModelEntry* table = reinterpret_cast<const ModelEntry*>(h + 1);
+  bool ok = (h->version == MODEL_VERSION) && (h->precision <= INT8)
+    && (h->nparams + h->nlookups == want.size())
+    && (h->nlookups == model.lookup_parameters_list().size())
+    && ((uint64_t)st.st_size >= bytes)
+    && ((type.size() == 0) || (h->type[0] == '\0') 
+	|| (strncmp(h->type, type.c_str(), sizeof(h->type)) == 0));
+  for (unsigned k = 0; ok && (k < want.size()); k++)
+    ok = (table[k].nd == want[k].nd) && (table[k].rows == want[k].rows)
+      && (memcmp(table[k].d, want[k].d, sizeof(want[k].d)) == 0)
+      && (table[k].offset == want[k].offset);
+  if (!ok){
+    munmap(mem, st.st_size);
+    cerr << fname << " does not match the model" << endl;
+    return -1;
+  }
+  unsigned k = 0;
+  if (h->precision != FP32){
+    // 16-bit or int8 values, turned into fp32 parameters
+    unsigned precision = h->precision;
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+    for (auto p : model.parameters_list()){
+      read_block(base + table[k].offset, p->values.v, table[k], precision);
+      k++;
+    }
+    for (auto p : model.lookup_parameters_list()){
+      const char* v = base + table[k].offset;
+      for (auto& t : p->values){
+	read_block(v, t.v, table[k], precision);
+	v += block_bytes(table[k], precision);
+      }
+      k++;
+    }
+    munmap(mem, st.st_size);
+    return 0;
+  }
+  // parameters read their values from the map, which 
+  //   lives as long as the process
+  for (auto p : model.parameters_list())
+    p->values.v = reinterpret_cast<float*>(base + table[k++].offset);
+  for (auto p : model.lookup_parameters_list()){
+    float* v = reinterpret_cast<float*>(base + table[k++].offset);
+    for (auto& t : p->values){
+      t.v = v;
+      v += p->dim.size();
+    }
+  }
+  return 0;
+}
+
+// writes the values of a model file block by block, in
+//   its precision
+class ModelWriter {
+  ofstream out;
+  unsigned precision;
+  vector<uint16_t> buffer;
+  vector<int8_t> quantized;
+  vector<float> scales;
+public:
+  ModelWriter(const string& fname, unsigned precision)
+    :out(fname, ios::binary), precision(precision){}
+  void write(const void* data, size_t bytes){
+    out.write(static_cast<const char*>(data), bytes);
+  }
+  // pad up to the offset of the next block
+  void seek(uint64_t offset){
+    static const char zeros[64] = {0};
+    out.write(zeros, offset - out.tellp());
+  }
+  void values(const float* v, const ModelEntry& e){
+    size_t n = block_values(e);
+    if (precision == FP32){
+      write(v, n * sizeof(float));
+      return;
+    }
+    if (precision == INT8){
+      scales.resize(block_scales(e));
+      quantized.resize(n);
+      quantize_rows(v, n, scales.size(), scales.data(), quantized.data());
+      write(scales.data(), scales.size() * sizeof(float));
+      write(quantized.data(), n);
+      return;
+    }
+    buffer.resize(n);
+    narrow(v, buffer.data(), n, precision);
+    write(buffer.data(), n * sizeof(uint16_t));
+  }
+  bool close(){
+    out.close();
+    return out.good();
+  }
+};
+
+// a written temporary file takes the place of fname, so 
+//   that a reader never sees half of a model
+static int commit_file(const string& ftmp, const string& fname, bool ok){
+  if (!ok || (rename(ftmp.c_str(), fname.c_str()) != 0)){
+    remove(ftmp.c_str());
+    cerr << "Cannot write " << fname << endl;
+    return -1;
+  }
   return 0;
 }
 
 // *******************************************************
-// save model from a archive file
+// save model into a binary file
+// *******************************************************
+int save_model(string fname, Model& model, const string& type,
+	       Precision precision){
+  fname += ".model";
+  ModelHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MODEL_MAGIC, 8);
+  h.version = MODEL_VERSION;
+  h.precision = precision;
+  h.nparams = model.parameters_list().size();
+  h.nlookups = model.lookup_parameters_list().size();
+  for (auto p : model.lookup_parameters_list())
+    h.vocab = max<uint64_t>(h.vocab, p->values.size());
+  strncpy(h.type, type.c_str(), sizeof(h.type) - 1);
+  uint64_t bytes;
+  vector<ModelEntry> table = model_table(model, bytes, precision);
+  string ftmp = fname + ".tmp";
+  ModelWriter out(ftmp, precision);
+  out.write(&h, sizeof(h));
+  out.write(table.data(), table.size() * sizeof(ModelEntry));
+  unsigned k = 0;
+  for (auto p : model.parameters_list()){
+    out.seek(table[k].offset);
+    out.values(p->values.v, table[k]);
+    k++;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    out.seek(table[k].offset);
+    for (auto& t : p->values)
+      out.values(t.v, table[k]);
+    k++;
+  }
+  return commit_file(ftmp, fname, out.close());
+}
+
+// *******************************************************
+// rewrite a binary model file in another precision, 
+//   without building the model
+// *******************************************************
+int convert_model(string fname, Precision precision){
+  fname += ".model";
+  int fd = open(fname.c_str(), O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || (fstat(fd, &st) != 0) 
+      || (st.st_size < (off_t)sizeof(ModelHeader))){
+    if (fd >= 0) close(fd);
+    cerr << "Cannot open " << fname << endl;
+    return -1;
+  }
+  void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    cerr << "Cannot map " << fname << endl;
+    return -1;
+  }
+  const char* base = static_cast<const char*>(mem);
+  ModelHeader h = *static_cast<const ModelHeader*>(mem);
+  unsigned from = h.precision;
+  uint64_t n = (uint64_t)h.nparams + h.nlookups;
+  bool ok = (memcmp(h.magic, MODEL_MAGIC, 8) == 0) 
+    && (h.version == MODEL_VERSION) && (from <= INT8)
+    && ((uint64_t)st.st_size >= sizeof(ModelHeader) + n * sizeof(ModelEntry));
+  vector<ModelEntry> table, old;
+  if (ok){
+    const ModelEntry* t = reinterpret_cast<const ModelEntry*>(base + sizeof(h));
+    old.assign(t, t + n);
+    for (auto& e : old) ok = ok && (e.nd <= 7);
+    vector<ModelEntry> check = old;
+    ok = ok && (layout_table(check, from) <= (uint64_t)st.st_size);
+    for (unsigned k = 0; ok && (k < n); k++)
+      ok = (check[k].offset == old[k].offset);
+  }
+  if (!ok){
+    munmap(mem, st.st_size);
+    cerr << fname << " is not a binary model file" << endl;
+    return -1;
+  }
+  table = old;
+  layout_table(table, precision);
+  h.precision = precision;
+  string ftmp = fname + ".tmp";
+  ModelWriter out(ftmp, precision);
+  out.write(&h, sizeof(h));
+  out.write(table.data(), table.size() * sizeof(ModelEntry));
+  vector<float> values;
+  for (unsigned k = 0; k < n; k++){
+    out.seek(table[k].offset);
+    values.resize(block_values(old[k]));
+    const char* v = base + old[k].offset;
+    for (uint64_t r = 0; r < old[k].rows; r++){
+      read_block(v, values.data(), old[k], from);
+      out.values(values.data(), table[k]);
+      v += block_bytes(old[k], from);
+    }
+  }
+  munmap(mem, st.st_size);
+  return commit_file(ftmp, fname, out.close());
+}
+
+// *******************************************************
+// precision of the values in fname.model, FP32 for a 
+//   text archive, -1 if there is no such file
+// *******************************************************
+int model_precision(string fname){
+  ifstream in(fname + ".model", ios::binary);
+  if (!in.is_open()) return -1;
+  ModelHeader h;
+  if (!in.read(reinterpret_cast<char*>(&h), sizeof(h))
+      || (memcmp(h.magic, MODEL_MAGIC, 8) != 0))
+    return FP32;
+  return h.precision;
+}
+
+// *******************************************************
+// Binary dict file: a header, the seed of every bucket, 
+//   the word id of every slot, the offsets of the words 
+//   in the string table, and the string table. A word 
+//   goes into bucket h % nbuckets of its hash h, and the
+//   seed of the bucket moves all of its words into free
+//   slots, which makes the hash minimal and perfect.
+// *******************************************************
+struct DictHeader {
+  char magic[8];
+  uint32_t nwords, nbuckets;
+  int32_t unk; // id of UNK, -1 if there is none
+  uint32_t reserved;
+  uint64_t strings_bytes;
+  uint64_t fingerprint; // dict_fingerprint of the words
+};
+
+static const char DICT_MAGIC[8] = {'D','C','L','M','D','C','T','2'};
+
+// FNV-1a hash of all words of a dict in index order
+static uint64_t dict_fingerprint(cnn::Dict* dptr){
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned i = 0; i < dptr->size(); i++){
+    for (auto c : dptr->Convert(i)){
+      h ^= (unsigned char)c; h *= 1099511628211ULL;
+    }
+    h ^= '\n'; h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t word_hash(const char* w, size_t n){
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++){
+    h ^= (unsigned char)w[i]; h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// slot of a word with hash h under a bucket seed
+static uint32_t word_slot(uint64_t h, uint32_t seed, uint32_t nwords){
+  h ^= (seed + 1) * 0x9E3779B97F4A7C15ULL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h % nwords;
+}
+
+// offsets of the arrays after the header
+static void dict_layout(uint32_t nwords, uint32_t nbuckets, 
+			uint64_t& oslots, uint64_t& ooffsets, 
+			uint64_t& ostrings){
+  oslots = sizeof(DictHeader) + nbuckets * sizeof(uint32_t);
+  ooffsets = oslots + nwords * sizeof(uint32_t);
+  ooffsets = (ooffsets + 7) / 8 * 8;
+  ostrings = ooffsets + (nwords + 1) * sizeof(uint64_t);
+}
+
+FastDict::FastDict()
+  :mem(nullptr), bytes(0), seeds(nullptr), slots(nullptr), 
+   offsets(nullptr), strings(nullptr), nwords(0), nbuckets(0),
+   unk(-1), hash(0){}
+
+FastDict::~FastDict(){
+  if (mem != nullptr) munmap(mem, bytes);
+}
+
+// *******************************************************
+// write the binary file of a dict: buckets are placed
+//   from the largest to the smallest, each with the 
+//   first seed that puts its words into free slots
 // *******************************************************
-int save_model(string fname, Model& model){
-  ofstream out(fname + ".model");
-  boost::archive::text_oarchive oa(out);
-  oa << model; 
+int FastDict::save(const string& fname, cnn::Dict& d){
+  uint32_t n = d.size(), nb = n / 4 + 1;
+  vector<uint64_t> hashes(n);
+  vector<vector<uint32_t>> buckets(nb);
+  for (uint32_t i = 0; i < n; i++){
+    const string& w = d.Convert(i);
+    hashes[i] = word_hash(w.data(), w.size());
+    buckets[(hashes[i] >> 32) % nb].push_back(i);
+  }
+  vector<uint32_t> order(nb);
+  for (uint32_t b = 0; b < nb; b++) order[b] = b;
+  stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){
+      return buckets[a].size() > buckets[b].size(); });
+  vector<uint32_t> seeds(nb, 0), slots(n, UINT32_MAX), taken;
+  for (auto b : order){
+    if (buckets[b].empty()) break;
+    uint32_t seed = 0;
+    while (true){
+      taken.clear();
+      for (auto i : buckets[b]){
+	uint32_t s = word_slot(hashes[i], seed, n);
+	if ((slots[s] != UINT32_MAX) 
+	    || (find(taken.begin(), taken.end(), s) != taken.end()))
+	  break;
+	taken.push_back(s);
+      }
+      if (taken.size() == buckets[b].size()) break;
+      if (++seed == (1u << 24)){
+	cerr << "Cannot build a perfect hash for the dict" << endl;
+	return -1;
+      }
+    }
+    seeds[b] = seed;
+    for (unsigned k = 0; k < taken.size(); k++) 
+      slots[taken[k]] = buckets[b][k];
+  }
+  DictHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, DICT_MAGIC, 8);
+  h.nwords = n; h.nbuckets = nb;
+  h.unk = d.Contains("UNK") ? d.Convert("UNK") : -1;
+  h.fingerprint = dict_fingerprint(&d);
+  vector<uint64_t> offsets(1, 0);
+  string strings;
+  for (uint32_t i = 0; i < n; i++){
+    strings += d.Convert(i);
+    offsets.push_back(strings.size());
+  }
+  h.strings_bytes = strings.size();
+  uint64_t oslots, ooffsets, ostrings;
+  dict_layout(n, nb, oslots, ooffsets, ostrings);
+  string ftmp = fname + ".tmp";
+  ofstream out(ftmp, ios::binary);
+  out.write((const char*)&h, sizeof(h));
+  out.write((const char*)seeds.data(), nb * sizeof(uint32_t));
+  out.write((const char*)slots.data(), n * sizeof(uint32_t));
+  const char zeros[8] = {0};
+  out.write(zeros, ooffsets - out.tellp());
+  out.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+  out.write(strings.data(), strings.size());
   out.close();
+  if (!out.good() || (rename(ftmp.c_str(), fname.c_str()) != 0)){
+    remove(ftmp.c_str());
+    cerr << "Cannot write " << fname << endl;
+    return -1;
+  }
+  return 0;
+}
+
+// *******************************************************
+// map a binary dict file, return -1 if it is missing or
+//   broken: the arrays must fill the file exactly, every
+//   slot must hold a word id, and the offsets must run 
+//   from 0 to the end of the string table in order
+// *******************************************************
+int FastDict::open(const string& fname){
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(DictHeader))){
+    close(fd);
+    return -1;
+  }
+  void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return -1;
+  const DictHeader* h = static_cast<const DictHeader*>(m);
+  const char* base = static_cast<const char*>(m);
+  uint64_t size = st.st_size;
+  uint64_t oslots, ooffsets, ostrings;
+  dict_layout(h->nwords, h->nbuckets, oslots, ooffsets, ostrings);
+  bool ok = (memcmp(h->magic, DICT_MAGIC, 8) == 0) && (h->nbuckets > 0)
+    && (ostrings <= size) && (h->strings_bytes == size - ostrings)
+    && (h->unk >= -1) && (h->unk < (int64_t)h->nwords);
+  const uint32_t* s = reinterpret_cast<const uint32_t*>(base + oslots);
+  const uint64_t* o = reinterpret_cast<const uint64_t*>(base + ooffsets);
+  for (uint32_t i = 0; ok && (i < h->nwords); i++)
+    ok = (s[i] < h->nwords) && (o[i] <= o[i + 1]);
+  ok = ok && (o[0] == 0) && (o[h->nwords] == h->strings_bytes);
+  if (!ok){
+    munmap(m, st.st_size);
+    return -1;
+  }
+  if (mem != nullptr) munmap(mem, bytes);
+  mem = m; bytes = st.st_size;
+  nwords = h->nwords; nbuckets = h->nbuckets; unk = h->unk;
+  hash = h->fingerprint;
+  seeds = reinterpret_cast<const uint32_t*>(base + sizeof(DictHeader));
+  slots = s;
+  offsets = o;
+  strings = base + ostrings;
   return 0;
 }
 
+int FastDict::lookup(const char* w, size_t n) const {
+  if (nwords == 0) return -1;
+  uint64_t h = word_hash(w, n);
+  uint32_t id = slots[word_slot(h, seeds[(h >> 32) % nbuckets], nwords)];
+  if ((offsets[id + 1] - offsets[id] != n) 
+      || (memcmp(strings + offsets[id], w, n) != 0)) 
+    return -1;
+  return id;
+}
+
+string FastDict::word(int id) const {
+  return string(strings + offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+void FastDict::fill(cnn::Dict& d) const {
+  for (uint32_t i = 0; i < nwords; i++) d.Convert(word(i));
+}
+
 // *******************************************************
-// save dict from a archive file
+// save dict into a archive file, and into a binary file
+//   for fast loading
 // *******************************************************
 int save_dict(string fname, cnn::Dict d){
+  if (FastDict::save(fname + ".dict.bin", d) != 0) 
+    remove((fname + ".dict.bin").c_str());
   fname += ".dict";
   ofstream out(fname);
   boost::archive::text_oarchive odict(out);
@@ -33,9 +826,19 @@ int save_dict(string fname, cnn::Dict d){
 }
 
 // *******************************************************
-// load dict from a archive file
+// load dict from its binary file, or from the archive 
+//   file if there is no binary one
 // *******************************************************
-int load_dict(string fname, cnn::Dict& d){
+int load_dict(string fname, cnn::Dict& d, FastDict* fast){
+  if (fast != nullptr){
+    if (fast->open(fname + ".dict.bin") == 0) return 0;
+  } else {
+    FastDict local;
+    if (local.open(fname + ".dict.bin") == 0){
+      local.fill(d);
+      return 0;
+    }
+  }
   fname += ".dict";
   ifstream in(fname);
   boost::archive::text_iarchive ia(in);
@@ -46,19 +849,17 @@ int load_dict(string fname, cnn::Dict& d){
 // *******************************************************
 // read sentences and convect tokens to indices
 // *******************************************************
-Sent MyReadSentence(const std::string& line, 
-		    Dict* sd, 
-		    bool update) {
+vector<int> MyReadSentence(const std::string& line, 
+			   Dict* sd, 
+			   bool update) {
   vector<string> strs;
   // boost::split(strs, line, boost::is_any_of(" "));
   istringstream in(line);
   string word;
-  Sent res;
+  vector<int> res;
   res.push_back(sd->Convert("<s>"));
   // for (auto& word : strs){
-  while (in){
-    in >> word;
-    if (word.empty()) break;
+  while (in >> word){
     // cerr << "word = " << word << endl;
     if (update){
       res.push_back(sd->Convert(word));
@@ -74,52 +875,771 @@ Sent MyReadSentence(const std::string& line,
   return res;
 }
 
+vector<int> MyReadSentence(const std::string& line, 
+			   const FastDict& fd){
+  vector<int> res;
+  res.push_back(fd.convert("<s>", 3));
+  const char* p = line.data();
+  const char* end = p + line.size();
+  while (p < end){
+    while ((p < end) && isspace((unsigned char)*p)) ++p;
+    const char* w = p;
+    while ((p < end) && !isspace((unsigned char)*p)) ++p;
+    if (p > w) res.push_back(fd.convert(w, p - w));
+  }
+  res.push_back(fd.convert("</s>", 4));
+  return res;
+}
+
 // *****************************************************
 // 
 // *****************************************************
 Doc makeDoc(){
-  vector<vector<int>> doc;
-  return doc;
+  return Doc();
+}
+
+// *****************************************************
+// Flat corpus storage
+// *****************************************************
+CorpusStore::~CorpusStore(){
+  if (map != nullptr) munmap(map, maplen);
+}
+
+Corpus::Corpus(shared_ptr<CorpusStore> store, const int* toks, 
+	       const uint64_t* sentoffs, uint64_t nsents,
+	       const uint64_t* docoffs, uint64_t ndocs):store(store){
+  store->sents.clear();
+  store->sents.reserve(nsents);
+  for (uint64_t i = 0; i < nsents; i++)
+    store->sents.push_back(Sent(toks + sentoffs[i], toks + sentoffs[i+1]));
+  const Sent* sents = store->sents.data();
+  docs.reserve(ndocs);
+  for (uint64_t j = 0; j < ndocs; j++)
+    docs.push_back(Doc(sents + docoffs[j], sents + docoffs[j+1]));
+}
+
+// *****************************************************
+// Binary corpus cache, written next to the text file 
+//   as <filename>.bin: a header, the words the reading 
+//   added to the dict (one per line), document offsets 
+//   into the sentence table, sentence offsets into the 
+//   token array, and the int32 tokens. A cache is only 
+//   used with the same text file and the same dict as 
+//   when it was written.
+// *****************************************************
+struct CorpusHeader {
+  char magic[8];
+  uint64_t source_size, source_mtime;
+  uint64_t fingerprint; // of the dict before reading
+  uint32_t update, nwords; // words added to the dict
+  uint64_t ndocs, nsents, ntoks, words_bytes;
+};
+
+static const char CORPUS_MAGIC[8] = {'D','C','L','M','C','R','P','2'};
+
+// load a corpus from its cache, return -1 if there is no 
+//   usable cache
+static int load_corpus_cache(const string& fname, 
+			     const CorpusHeader& want,
+			     cnn::Dict* dptr, Corpus& corpus){
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(CorpusHeader))){
+    close(fd); return -1;
+  }
+  void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return -1;
+  const CorpusHeader* h = static_cast<const CorpusHeader*>(mem);
+  const char* words = static_cast<const char*>(mem) + sizeof(CorpusHeader);
+  size_t padded = (h->words_bytes + 7) / 8 * 8;
+  const uint64_t* docs = reinterpret_cast<const uint64_t*>(words + padded);
+  const uint64_t* sents = docs + h->ndocs + 1;
+  const int32_t* toks = reinterpret_cast<const int32_t*>(sents + h->nsents + 1);
+  bool ok = (memcmp(h->magic, CORPUS_MAGIC, 8) == 0)
+    && (h->source_size == want.source_size)
+    && (h->source_mtime == want.source_mtime)
+    && (h->fingerprint == want.fingerprint)
+    && (h->update == want.update)
+    && ((const char*)(toks + h->ntoks) 
+	<= static_cast<const char*>(mem) + st.st_size);
+  if (!ok){
+    munmap(mem, st.st_size);
+    return -1;
+  }
+  // replay the words this file added to the dict
+  const char* w = words;
+  for (unsigned i = 0; i < h->nwords; i++){
+    const char* e = static_cast<const char*>(memchr(w, '\n', words + h->words_bytes - w));
+    dptr->Convert(string(w, e));
+    w = e + 1;
+  }
+  // tokens stay in the mapped file
+  auto store = make_shared<CorpusStore>();
+  store->map = mem;
+  store->maplen = st.st_size;
+  corpus = Corpus(store, toks, sents, h->nsents, docs, h->ndocs);
+  return 0;
+}
+
+// write the cache of a corpus, return -1 on failure
+static int save_corpus_cache(const string& fname, CorpusHeader h,
+			     cnn::Dict* dptr, unsigned oldsize,
+			     const Corpus& corpus){
+  string words;
+  for (unsigned i = oldsize; i < dptr->size(); i++)
+    words += dptr->Convert(i) + '\n';
+  vector<uint64_t> docs(1, 0), sents(1, 0);
+  vector<int32_t> toks;
+  for (auto& doc : corpus){
+    for (auto& sent : doc){
+      toks.insert(toks.end(), sent.begin(), sent.end());
+      sents.push_back(toks.size());
+    }
+    docs.push_back(sents.size() - 1);
+  }
+  memcpy(h.magic, CORPUS_MAGIC, 8);
+  h.nwords = dptr->size() - oldsize;
+  h.ndocs = corpus.size(); h.nsents = sents.size() - 1;
+  h.ntoks = toks.size(); h.words_bytes = words.size();
+  words.resize((words.size() + 7) / 8 * 8, '\0');
+  // write to a temporary file first, so that a reader 
+  //   never sees half of a cache
+  string ftmp = fname + ".tmp";
+  ofstream out(ftmp, ios::binary);
+  out.write((const char*)&h, sizeof(h));
+  out.write(words.data(), words.size());
+  out.write((const char*)docs.data(), docs.size() * sizeof(uint64_t));
+  out.write((const char*)sents.data(), sents.size() * sizeof(uint64_t));
+  out.write((const char*)toks.data(), toks.size() * sizeof(int32_t));
+  out.close();
+  if (!out.good() || (rename(ftmp.c_str(), fname.c_str()) != 0)){
+    remove(ftmp.c_str());
+    return -1;
+  }
+  return 0;
 }
 
 // *****************************************************
-// read training and dev data
+// Compressed corpus archive: a header, the words of the
+//   archive (one per line, the most frequent first), a
+//   block index and the blocks. A block holds whole 
+//   documents, each as its number of sentences, then 
+//   every sentence as its length and its token ids, all 
+//   as LEB128 varints. <s> and </s> are left out, and 
+//   since ids follow frequency most tokens take one 
+//   byte. Each index entry has the first document, 
+//   sentence and token of its block (counting <s> and 
+//   </s>) and where the block starts, plus one entry 
+//   for the end, so blocks decode in parallel straight 
+//   into their part of the flat buffers, and a range of
+//   documents decodes without the rest.
+// *****************************************************
+struct ArchiveHeader {
+  char magic[8];
+  uint64_t nwords, ndocs, nsents, ntoks, nblocks, words_bytes;
+};
+
+struct ArchiveBlock {
+  uint64_t doc, sent, tok, offset;
+};
+
+static const char ARCHIVE_MAGIC[8] = {'D','C','L','M','V','Z','0','1'};
+// a block ends after the document that takes it past 
+//   this many bytes
+static const size_t ARCHIVE_BLOCK_BYTES = 1 << 16;
+
+static void put_varint(string& out, uint64_t x){
+  while (x >= 0x80){
+    out += (char)((x & 0x7f) | 0x80);
+    x >>= 7;
+  }
+  out += (char)x;
+}
+
+// false if the number runs past end, or past 64 bits
+static bool get_varint(const unsigned char*& p, const unsigned char* end,
+		       uint64_t& x){
+  x = 0;
+  for (unsigned shift = 0; (shift < 64) && (p < end); shift += 7){
+    unsigned char b = *p++;
+    x |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80) return true;
+  }
+  return false;
+}
+
+bool is_archive(const char* filename){
+  ifstream in(filename, ios::binary);
+  char magic[8];
+  return in.read(magic, 8) && (memcmp(magic, ARCHIVE_MAGIC, 8) == 0);
+}
+
+int save_archive(const string& fname, const Corpus& corpus, 
+		 cnn::Dict* dptr){
+  int kSOS = dptr->Convert("<s>"), kEOS = dptr->Convert("</s>");
+  // archive ids by descending frequency
+  vector<unsigned> counts(dptr->size(), 0);
+  for (auto& doc : corpus)
+    for (auto& sent : doc)
+      for (size_t t = 1; t + 1 < sent.size(); t++) counts[sent[t]] ++;
+  vector<int> byfreq;
+  for (unsigned w = 0; w < counts.size(); w++)
+    if (counts[w] > 0) byfreq.push_back(w);
+  stable_sort(byfreq.begin(), byfreq.end(), 
+	      [&](int a, int b){ return counts[a] > counts[b]; });
+  vector<uint64_t> aid(dptr->size(), 0);
+  string words;
+  for (unsigned i = 0; i < byfreq.size(); i++){
+    aid[byfreq[i]] = i;
+    words += dptr->Convert(byfreq[i]) + '\n';
+  }
+  // encode documents block by block
+  ArchiveHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, ARCHIVE_MAGIC, 8);
+  vector<ArchiveBlock> index;
+  string blocks;
+  size_t start = 0;
+  for (auto& doc : corpus){
+    if ((index.size() == 0) || (blocks.size() - start >= ARCHIVE_BLOCK_BYTES)){
+      index.push_back(ArchiveBlock{h.ndocs, h.nsents, h.ntoks, blocks.size()});
+      start = blocks.size();
+    }
+    put_varint(blocks, doc.size());
+    for (auto& sent : doc){
+      if ((sent.size() < 2) || (sent[0] != kSOS) || (sent.back() != kEOS)){
+	cerr << "Cannot archive a sentence without <s> and </s>" << endl;
+	return -1;
+      }
+      put_varint(blocks, sent.size() - 2);
+      for (size_t t = 1; t + 1 < sent.size(); t++) 
+	put_varint(blocks, aid[sent[t]]);
+      h.ntoks += sent.size();
+    }
+    h.nsents += doc.size();
+    h.ndocs ++;
+  }
+  h.nblocks = index.size();
+  index.push_back(ArchiveBlock{h.ndocs, h.nsents, h.ntoks, blocks.size()});
+  h.nwords = byfreq.size();
+  h.words_bytes = words.size();
+  words.resize((words.size() + 7) / 8 * 8, '\0');
+  string ftmp = fname + ".tmp";
+  ofstream out(ftmp, ios::binary);
+  out.write((const char*)&h, sizeof(h));
+  out.write(words.data(), words.size());
+  out.write((const char*)index.data(), index.size() * sizeof(ArchiveBlock));
+  out.write(blocks.data(), blocks.size());
+  out.close();
+  if (!out.good() || (rename(ftmp.c_str(), fname.c_str()) != 0)){
+    remove(ftmp.c_str());
+    return -1;
+  }
+  cerr << corpus.size() << " docs, " << h.ntoks << " tokens in " 
+       << h.nblocks << " blocks, " << blocks.size() << " bytes of tokens" 
+       << endl;
+  return 0;
+}
+
+Corpus load_archive(const char* filename, cnn::Dict* dptr, 
+		    bool b_update, uint64_t first, uint64_t count,
+		    const FastDict* fast){
+  // without update, a frozen dict is looked up in fast
+  if (b_update) fast = nullptr;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0){
+    cerr << "Cannot open " << filename << endl;
+    return Corpus();
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(ArchiveHeader))){
+    close(fd);
+    cerr << "Cannot read " << filename << endl;
+    return Corpus();
+  }
+  void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    cerr << "Cannot map " << filename << endl;
+    return Corpus();
+  }
+  const char* base = static_cast<const char*>(mem);
+  const ArchiveHeader* h = static_cast<const ArchiveHeader*>(mem);
+  const char* words = base + sizeof(ArchiveHeader);
+  const ArchiveBlock* index = nullptr;
+  const unsigned char* blocks = nullptr;
+  // the word list and the block index have to fit into
+  //   the file before anything points into them
+  uint64_t room = st.st_size - sizeof(ArchiveHeader);
+  bool ok = (memcmp(h->magic, ARCHIVE_MAGIC, 8) == 0) 
+    && (h->words_bytes <= room) && (h->nwords <= h->words_bytes);
+  uint64_t wbytes = ok ? (h->words_bytes + 7) / 8 * 8 : 0;
+  ok = ok && (wbytes <= room) 
+    && (h->nblocks < (room - wbytes) / sizeof(ArchiveBlock));
+  if (ok){
+    index = reinterpret_cast<const ArchiveBlock*>(words + wbytes);
+    blocks = reinterpret_cast<const unsigned char*>(index + h->nblocks + 1);
+    uint64_t nbytes = base + st.st_size - (const char*)blocks;
+    const ArchiveBlock& total = index[h->nblocks];
+    ok = (index[0].doc == 0) && (index[0].sent == 0) 
+      && (index[0].tok == 0) && (index[0].offset == 0)
+      && (total.doc == h->ndocs) && (total.sent == h->nsents)
+      && (total.tok == h->ntoks) && (total.offset <= nbytes);
+    // blocks follow each other, and hold no more documents,
+    //   sentences or tokens than their bytes can encode
+    for (uint64_t b = 0; ok && (b < h->nblocks); b++){
+      const ArchiveBlock &x = index[b], &y = index[b + 1];
+      ok = (x.offset <= y.offset) && (x.doc <= y.doc) 
+	&& (x.sent <= y.sent) && (x.tok <= y.tok)
+	&& (y.doc - x.doc <= y.offset - x.offset)
+	&& (y.sent - x.sent <= y.offset - x.offset)
+	&& (y.tok - x.tok <= 2 * (y.offset - x.offset));
+    }
+  }
+  if (!ok){
+    munmap(mem, st.st_size);
+    cerr << "Not a corpus archive: " << filename << endl;
+    return Corpus();
+  }
+  cerr << "reading data from " << filename << endl;
+  // map archive ids to dict ids
+  int kSOS = fast ? fast->convert("<s>", 3) : dptr->Convert("<s>");
+  int kEOS = fast ? fast->convert("</s>", 4) : dptr->Convert("</s>");
+  vector<int> ids;
+  const char* w = words;
+  for (uint64_t i = 0; i < h->nwords; i++){
+    const char* e = static_cast<const char*>(memchr(w, '\n', words + h->words_bytes - w));
+    if (e == nullptr){
+      munmap(mem, st.st_size);
+      cerr << "Corrupt word list in " << filename << endl;
+      return Corpus();
+    }
+    string word(w, e);
+    if (fast) ids.push_back(fast->convert(w, e - w));
+    else if (b_update || dptr->Contains(word)) 
+      ids.push_back(dptr->Convert(word));
+    else ids.push_back(dptr->Convert("UNK"));
+    w = e + 1;
+  }
+  // the blocks holding documents [first, last)
+  uint64_t last = (count > h->ndocs - min(first, h->ndocs)) ? 
+    h->ndocs : first + count;
+  first = min(first, last);
+  uint64_t b0 = 0, b1 = 0;
+  while ((b0 + 1 < h->nblocks) && (index[b0 + 1].doc <= first)) b0 ++;
+  b1 = b0;
+  while ((b1 < h->nblocks) && (index[b1].doc < last)) b1 ++;
+  const ArchiveBlock lo = index[b0], hi = index[b1];
+  auto store = make_shared<CorpusStore>();
+  store->toks.resize(hi.tok - lo.tok);
+  vector<uint64_t> sents(hi.sent - lo.sent + 1), docs(hi.doc - lo.doc + 1);
+  sents.back() = store->toks.size();
+  docs.back() = sents.size() - 1;
+  // decode blocks in parallel, each into its own part;
+  //   false if a block does not hold what its index says
+  auto decode = [&](uint64_t b) -> bool {
+    const unsigned char* p = blocks + index[b].offset;
+    const unsigned char* end = blocks + index[b + 1].offset;
+    uint64_t tok = index[b].tok - lo.tok, sent = index[b].sent - lo.sent;
+    uint64_t tokend = index[b + 1].tok - lo.tok;
+    uint64_t sentend = index[b + 1].sent - lo.sent;
+    uint64_t nsents, len, id;
+    for (uint64_t j = index[b].doc; j < index[b + 1].doc; j++){
+      docs[j - lo.doc] = sent;
+      if (!get_varint(p, end, nsents) || (nsents > sentend - sent))
+	return false;
+      for (uint64_t k = 0; k < nsents; k++){
+	sents[sent++] = tok;
+	if (!get_varint(p, end, len) || (tokend - tok < 2) 
+	    || (len > tokend - tok - 2))
+	  return false;
+	store->toks[tok++] = kSOS;
+	for (uint64_t t = 0; t < len; t++){
+	  if (!get_varint(p, end, id) || (id >= ids.size())) return false;
+	  store->toks[tok++] = ids[id];
+	}
+	store->toks[tok++] = kEOS;
+      }
+    }
+    return (sent == sentend) && (tok == tokend);
+  };
+  unsigned nthreads = max(1u, thread::hardware_concurrency());
+  atomic<bool> failed(false);
+  vector<thread> workers;
+  for (unsigned r = 0; r < nthreads; r++)
+    workers.push_back(thread([&, r](){
+	  for (uint64_t b = b0 + r; b < b1; b += nthreads) 
+	    if (!decode(b)) failed = true;
+	}));
+  for (auto& t : workers) t.join();
+  munmap(mem, st.st_size);
+  if (failed){
+    cerr << "Corrupt blocks in " << filename << endl;
+    return Corpus();
+  }
+  Corpus all(store, store->toks.data(), sents.data(), sents.size() - 1,
+	     docs.data(), docs.size() - 1);
+  vector<Doc> range(all.begin() + (first - lo.doc), 
+		    all.begin() + (last - lo.doc));
+  cerr << range.size() << " docs, " << store->toks.size() << " tokens, "
+       << (fast ? fast->size() : dptr->size()) << " types." << endl;
+  return Corpus(store, range);
+}
+
+// *****************************************************
+// read training and dev data, from the binary cache of 
+//   the file if there is a valid one
 // *****************************************************
 Corpus readData(char* filename, 
 		cnn::Dict* dptr,
-		bool b_update){
-  cerr << "reading data from "<< filename << endl;
-  Corpus corpus;
-  Doc doc;
-  Sent sent;
-  string line;
-  int tlc = 0;
-  int toks = 0;
-  ifstream in(filename);
-  while(getline(in, line)){
-    ++tlc;
-    if (line[0] != '='){
-      sent = MyReadSentence(line, dptr, b_update);
-      if (sent.size() > 0){
-	doc.push_back(sent);
-	toks += doc.back().size();
+		bool b_update,
+		const FastDict* fast){
+  if (is_archive(filename)) 
+    return load_archive(filename, dptr, b_update, 0, UINT64_MAX, fast);
+  // without update, fast stands for the dict
+  if (b_update) fast = nullptr;
+  CorpusHeader h;
+  memset(&h, 0, sizeof(h));
+  struct stat st;
+  bool cacheable = (stat(filename, &st) == 0);
+  string fcache = string(filename) + ".bin";
+  if (cacheable){
+    h.source_size = st.st_size;
+    h.source_mtime = st.st_mtime;
+    h.fingerprint = fast ? fast->fingerprint() : dict_fingerprint(dptr);
+    h.update = b_update;
+    Corpus corpus;
+    if (load_corpus_cache(fcache, h, dptr, corpus) == 0){
+      cerr << "reading data from " << fcache << endl;
+      size_t toks = 0;
+      for (auto& doc : corpus)
+	for (auto& sent : doc) toks += sent.size();
+      cerr << corpus.size() << " docs, " << toks << " tokens, "
+	   << (fast ? fast->size() : dptr->size()) << " types." << endl;
+      return corpus;
+    }
+  }
+  unsigned oldsize = dptr->size();
+  Corpus corpus = parseData(filename, dptr, b_update, fast);
+  if (cacheable && (save_corpus_cache(fcache, h, dptr, oldsize, corpus) != 0))
+    cerr << "Cannot write corpus cache: " << fcache << endl;
+  return corpus;
+}
+
+// *****************************************************
+// Parallel parsing of a text corpus. The file is mapped
+//   into memory and cut into chunks right after lines
+//   starting with '=', so every chunk starts with a new
+//   document. Each thread tokenizes one chunk in place 
+//   with its own vocabulary, and the vocabularies are 
+//   merged into the dict chunk by chunk, which gives 
+//   words the same ids as a sequential read.
+// *****************************************************
+struct Span {
+  const char* p;
+  size_t n;
+  bool operator==(const Span& o) const {
+    return (n == o.n) && (memcmp(p, o.p, n) == 0);
+  }
+};
+
+struct SpanHash {
+  size_t operator()(const Span& w) const {
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < w.n; i++){
+      h ^= (unsigned char)w.p[i]; h *= 1099511628211ULL;
+    }
+    return h;
+  }
+};
+
+struct Chunk {
+  const char *begin, *end;
+  vector<Span> words; // local vocabulary, first seen first
+  vector<int> toks; // local word ids
+  vector<size_t> sents; // end of each sentence in toks
+  vector<size_t> docs; // end of each document in sents
+  unsigned lines, empty_docs;
+};
+
+static void tokenize_chunk(Chunk& c){
+  unordered_map<Span, int, SpanHash> vocab;
+  auto local = [&](Span w){
+    auto it = vocab.find(w);
+    if (it != vocab.end()) return it->second;
+    int id = c.words.size();
+    vocab[w] = id;
+    c.words.push_back(w);
+    return id;
+  };
+  const Span bos = {"<s>", 3}, eos = {"</s>", 4};
+  c.lines = 0; c.empty_docs = 0;
+  size_t docstart = 0;
+  const char* pos = c.begin;
+  while (pos < c.end){
+    const char* nl = static_cast<const char*>(memchr(pos, '\n', c.end - pos));
+    if (nl == nullptr) nl = c.end;
+    ++c.lines;
+    if ((pos < nl) && (*pos == '=')){
+      if (c.sents.size() > docstart){
+	c.docs.push_back(c.sents.size());
+	docstart = c.sents.size();
       } else {
-	cerr << "Empty sentence: " << line << endl;
+	++c.empty_docs;
       }
     } else {
-      if (doc.size() > 0){
-	corpus.push_back(doc);
-	doc = makeDoc();
+      c.toks.push_back(local(bos));
+      const char* q = pos;
+      while (q < nl){
+	while ((q < nl) && isspace((unsigned char)*q)) ++q;
+	const char* w = q;
+	while ((q < nl) && !isspace((unsigned char)*q)) ++q;
+	if (q > w) c.toks.push_back(local({w, (size_t)(q - w)}));
+      }
+      c.toks.push_back(local(eos));
+      c.sents.push_back(c.toks.size());
+    }
+    pos = nl + 1;
+  }
+  if (c.sents.size() > docstart) c.docs.push_back(c.sents.size());
+}
+
+// copy a tokenized chunk into its part of the flat 
+//   buffers, with dict ids and global offsets
+static void flatten_chunk(const Chunk& c, const vector<int>& ids, 
+			  int* toks, uint64_t tokbase,
+			  uint64_t* sentends, uint64_t sentbase,
+			  uint64_t* docends){
+  for (size_t t = 0; t < c.toks.size(); t++)
+    toks[t] = ids[c.toks[t]];
+  for (size_t s = 0; s < c.sents.size(); s++)
+    sentends[s] = tokbase + c.sents[s];
+  for (size_t d = 0; d < c.docs.size(); d++)
+    docends[d] = sentbase + c.docs[d];
+}
+
+DocStream::DocStream(const string& filename, cnn::Dict* dptr,
+		     const FastDict* fast)
+  :in(&cin), dict(dptr), fast(fast), ndocs(0){
+  if (filename == "-") return;
+  file.open(filename);
+  in = &file;
+}
+
+bool DocStream::next(Corpus& doc){
+  auto store = make_shared<CorpusStore>();
+  vector<uint64_t> sents(1, 0);
+  string line;
+  while (getline(*in, line)){
+    if ((line.size() > 0) && (line[0] == '=')){
+      // skip empty documents
+      if (sents.size() > 1) break;
+      continue;
+    }
+    for (auto w : (fast ? MyReadSentence(line, *fast) 
+		   : MyReadSentence(line, dict, false)))
+      store->toks.push_back(w);
+    sents.push_back(store->toks.size());
+  }
+  if (sents.size() == 1) return false;
+  uint64_t docs[2] = {0, sents.size() - 1};
+  doc = Corpus(store, store->toks.data(), sents.data(), 
+	       sents.size() - 1, docs, 1);
+  ndocs ++;
+  return true;
+}
+
+bool Reservoir::next(Corpus& doc){
+  if (size == 0) return stream.next(doc);
+  Corpus fresh;
+  // fill the buffer on the first call
+  while (!ended && (buffer.size() < size)){
+    if (stream.next(fresh)) buffer.push_back(fresh);
+    else ended = true;
+  }
+  if (buffer.empty()) return false;
+  uniform_int_distribution<size_t> pick(0, buffer.size() - 1);
+  size_t i = pick(rng);
+  doc = buffer[i];
+  // the slot takes the next document of the stream, or
+  //   the last slot once the stream has ended
+  if (!ended && stream.next(fresh)){
+    buffer[i] = fresh;
+    return true;
+  }
+  ended = true;
+  buffer[i] = buffer.back();
+  buffer.pop_back();
+  return true;
+}
+
+// *****************************************************
+// read training data and finalize its vocabulary in a 
+//   counting pre-pass. The file is read (or taken from 
+//   its cache) with a scratch dict; the dict then gets 
+//   <s>, </s> and UNK, followed by the kept words from 
+//   the most to the least frequent, so that frequent 
+//   words share the first rows of the embedding and 
+//   output matrices. Tokens are mapped to the new ids, 
+//   dropped words to UNK.
+// *****************************************************
+Corpus readTrainingData(char* filename, 
+			cnn::Dict* dptr,
+			unsigned min_count,
+			unsigned max_size){
+  cnn::Dict scratch;
+  Corpus corpus = readData(filename, &scratch, true);
+  vector<unsigned> counts = count_words(corpus, scratch.size());
+  // most frequent words first, first seen first among equals
+  vector<int> byfreq(scratch.size());
+  for (unsigned i = 0; i < byfreq.size(); i++) byfreq[i] = i;
+  stable_sort(byfreq.begin(), byfreq.end(), 
+	      [&](int a, int b){ return counts[a] > counts[b]; });
+  dptr->Convert("<s>"); dptr->Convert("</s>");
+  int unk = dptr->Convert("UNK");
+  vector<int> idmap(scratch.size(), unk);
+  for (auto w : byfreq){
+    const string& word = scratch.Convert(w);
+    if (dptr->Contains(word)){
+      idmap[w] = dptr->Convert(word);
+      continue;
+    }
+    if (counts[w] < min_count) continue;
+    if ((max_size > 0) && (dptr->size() >= max_size)) continue;
+    idmap[w] = dptr->Convert(word);
+  }
+  cerr << "kept " << dptr->size() << " of " << scratch.size() 
+       << " types, sorted by frequency" << endl;
+  // ids that stay the same keep the corpus where it was
+  //   read (e.g. mapped from its cache)
+  bool identity = true;
+  for (unsigned w = 0; identity && (w < idmap.size()); w++)
+    identity = (idmap[w] == (int)w);
+  if (identity) return corpus;
+  return remap_corpus(corpus, idmap);
+}
+
+// *****************************************************
+// map every token of a corpus through idmap
+// *****************************************************
+Corpus remap_corpus(const Corpus& corpus, const vector<int>& idmap){
+  auto store = make_shared<CorpusStore>();
+  vector<uint64_t> sents(1, 0), docs(1, 0);
+  for (auto& doc : corpus){
+    for (auto& sent : doc){
+      for (auto w : sent) store->toks.push_back(idmap[w]);
+      sents.push_back(store->toks.size());
+    }
+    docs.push_back(sents.size() - 1);
+  }
+  return Corpus(store, store->toks.data(), sents.data(), 
+		sents.size() - 1, docs.data(), docs.size() - 1);
+}
+
+// *****************************************************
+// parse a text corpus: one sentence per line, documents
+//   separated by lines starting with '='
+// *****************************************************
+Corpus parseData(char* filename, 
+		 cnn::Dict* dptr,
+		 bool b_update,
+		 const FastDict* fast){
+  cerr << "reading data from "<< filename << endl;
+  Corpus corpus;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size == 0)){
+    if (fd >= 0) close(fd);
+    cerr << "0 docs, 0 lines, 0 tokens, " 
+	 << ((fast && !b_update) ? fast->size() : dptr->size())
+	 << " types." << endl;
+    return corpus;
+  }
+  size_t size = st.st_size;
+  void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    cerr << "Cannot map " << filename << endl;
+    return corpus;
+  }
+  madvise(mem, size, MADV_SEQUENTIAL);
+  const char* text = static_cast<const char*>(mem);
+  const char* end = text + size;
+  // chunks of at least a few MB, one per core at most
+  size_t nthreads = max(1u, thread::hardware_concurrency());
+  size_t target = max((size_t)(4 << 20), size / nthreads + 1);
+  vector<Chunk> chunks;
+  const char* begin = text;
+  while (begin < end){
+    const char* cut = (end - begin > (ptrdiff_t)target) ? begin + target : end;
+    // move the cut past the next '=' line
+    while (cut < end){
+      const char* bol = static_cast<const char*>(memchr(cut, '\n', end - cut));
+      if (bol == nullptr) { cut = end; break; }
+      ++bol;
+      if ((bol < end) && (*bol == '=')){
+	const char* eol = static_cast<const char*>(memchr(bol, '\n', end - bol));
+	cut = (eol == nullptr) ? end : eol + 1;
+	break;
+      }
+      cut = bol;
+    }
+    Chunk c;
+    c.begin = begin; c.end = cut;
+    chunks.push_back(c);
+    begin = cut;
+  }
+  vector<thread> workers;
+  for (auto& c : chunks) workers.push_back(thread(tokenize_chunk, ref(c)));
+  for (auto& w : workers) w.join();
+  // merge the vocabularies in chunk order
+  vector<vector<int>> ids(chunks.size());
+  for (unsigned k = 0; k < chunks.size(); k++){
+    for (auto& w : chunks[k].words){
+      if (fast && !b_update){
+	ids[k].push_back(fast->convert(w.p, w.n));
+	continue;
+      }
+      string word(w.p, w.n);
+      if (b_update || (word == "<s>") || (word == "</s>") 
+	  || dptr->Contains(word)){
+	ids[k].push_back(dptr->Convert(word));
       } else {
-	cerr << "Empty document " << endl;
+	ids[k].push_back(dptr->Convert("UNK"));
       }
     }
   }
-  if (doc.size() > 0){
-    corpus.push_back(doc);
+  // map tokens to dict ids, every chunk into its own 
+  //   part of one flat buffer
+  vector<uint64_t> tokbase(1, 0), sentbase(1, 0), docbase(1, 0);
+  unsigned tlc = 0, empty = 0;
+  for (auto& c : chunks){
+    tokbase.push_back(tokbase.back() + c.toks.size());
+    sentbase.push_back(sentbase.back() + c.sents.size());
+    docbase.push_back(docbase.back() + c.docs.size());
+    tlc += c.lines; empty += c.empty_docs;
   }
+  auto store = make_shared<CorpusStore>();
+  store->toks.resize(tokbase.back());
+  vector<uint64_t> sents(sentbase.back() + 1, 0);
+  vector<uint64_t> docs(docbase.back() + 1, 0);
+  workers.clear();
+  for (unsigned k = 0; k < chunks.size(); k++)
+    workers.push_back(thread(flatten_chunk, cref(chunks[k]), cref(ids[k]),
+			     store->toks.data() + tokbase[k], tokbase[k],
+			     sents.data() + sentbase[k] + 1, sentbase[k],
+			     docs.data() + docbase[k] + 1));
+  for (auto& w : workers) w.join();
+  munmap(mem, size);
+  size_t toks = store->toks.size();
+  corpus = Corpus(store, store->toks.data(), sents.data(), 
+		  sents.size() - 1, docs.data(), docs.size() - 1);
+  if (empty > 0) cerr << empty << " empty documents" << endl;
   cerr << corpus.size() << " docs, " << tlc << " lines, " 
-       << toks << " tokens, " << dptr->size() 
+       << toks << " tokens, " 
+       << ((fast && !b_update) ? fast->size() : dptr->size())
        << " types." << endl;
   return(corpus);
 }
@@ -152,30 +1672,348 @@ int check_dir(string path){
 // ******************************************************
 // Segment a long document into several short ones
 // ******************************************************
-Corpus segment_doc(Corpus corpus, int thresh){
-  Corpus newcorpus;
+vector<Doc> segment_doc(const Doc& doc, int thresh){
+  // pieces of thresh+1 sentences, as views of the same 
+  //   sentences
+  vector<Doc> docs;
+  if (doc.size() <= thresh){
+    docs.push_back(doc);
+    return docs;
+  }
+  for (size_t k = 0; k < doc.size(); k += thresh + 1){
+    size_t e = min(doc.size(), k + thresh + 1);
+    docs.push_back(Doc(doc.begin() + k, doc.begin() + e));
+  }
+  return docs;
+}
+
+Corpus segment_doc(const Corpus& corpus, int thresh){
+  vector<Doc> docs;
+  for (auto& doc : corpus)
+    for (auto& piece : segment_doc(doc, thresh))
+      docs.push_back(piece);
+  return Corpus(corpus.get_store(), docs);
+}
+
+
+// ******************************************************
+// Cut points of a greedy packing of sentence lengths into
+//   units of at most cap tokens, a longer sentence is a 
+//   unit of its own
+// ******************************************************
+static vector<size_t> greedy_cuts(const vector<size_t>& lens, 
+				  size_t cap){
+  vector<size_t> cuts;
+  size_t fill = 0;
+  for (size_t k = 0; k < lens.size(); k++){
+    if ((k > 0) && (fill + lens[k] > cap)){
+      cuts.push_back(k);
+      fill = 0;
+    }
+    fill += lens[k];
+  }
+  return cuts;
+}
+
+// ******************************************************
+// Cut points that split sentence lengths into n units of
+//   about equal size: a unit ends before the sentence 
+//   whose middle passes the next multiple of total/n, or
+//   that would take it over cap tokens
+// ******************************************************
+static vector<size_t> balanced_cuts(const vector<size_t>& lens,
+				    size_t total, size_t n, 
+				    size_t cap){
+  vector<size_t> cuts;
+  size_t fill = 0, done = 0;
+  for (size_t k = 0; k < lens.size(); k++){
+    double mid = done + fill + lens[k] / 2.0;
+    if ((k > 0) && (fill > 0) && 
+	((mid * n > (cuts.size() + 1) * total) || 
+	 (fill + lens[k] > cap))){
+      cuts.push_back(k);
+      done += fill; fill = 0;
+    }
+    fill += lens[k];
+  }
+  return cuts;
+}
+
+// ******************************************************
+// Pack each document into units of at most budget tokens,
+//   cut at sentence boundaries and in document order. A 
+//   document gets as few units as the budget allows, of
+//   about equal size where the sentences permit it (else
+//   the packing with the smallest largest unit), so no 
+//   unit is left with a short trailing fragment.
+// ******************************************************
+vector<Doc> pack_doc(const Doc& doc, unsigned budget){
+  vector<size_t> lens;
+  size_t total = 0, longest = 0;
+  for (auto& sent : doc){
+    lens.push_back(sent.size());
+    total += sent.size();
+    longest = max(longest, sent.size());
+  }
+  vector<size_t> cuts = greedy_cuts(lens, budget);
+  // smallest cap that needs no more units than the budget
+  size_t lo = min<size_t>(longest, budget), hi = budget;
+  while (lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if (greedy_cuts(lens, mid).size() <= cuts.size()) hi = mid;
+    else lo = mid + 1;
+  }
+  vector<size_t> even = balanced_cuts(lens, total, 
+				      cuts.size() + 1, hi);
+  if (even.size() == cuts.size()) cuts = even;
+  else cuts = greedy_cuts(lens, hi);
+  cuts.push_back(doc.size());
+  vector<Doc> docs;
+  size_t first = 0;
+  for (auto cut : cuts){
+    if (cut == first) continue;
+    docs.push_back(Doc(doc.begin() + first, doc.begin() + cut));
+    first = cut;
+  }
+  return docs;
+}
+
+Corpus pack_doc(const Corpus& corpus, unsigned budget){
+  vector<Doc> docs;
+  size_t ntoks = 0, nover = 0, biggest = 0;
   for (auto& doc : corpus){
-    if (doc.size() <= thresh){
-      newcorpus.push_back(doc);
-      continue;
+    for (auto& unit : pack_doc(doc, budget)){
+      size_t fill = 0;
+      for (auto& sent : unit){
+	fill += sent.size();
+	if (sent.size() > budget) nover ++;
+      }
+      biggest = max(biggest, fill);
+      ntoks += fill;
+      docs.push_back(unit);
     }
-    Doc tmpdoc;
-    int counter = 0;
-    for (auto& sent : doc){
-      if (counter <= thresh){
-	tmpdoc.push_back(sent);
-	counter ++;
-      } else {
-	newcorpus.push_back(tmpdoc);
-	tmpdoc.clear();
-	tmpdoc.push_back(sent);
-	counter = 1;
+  }
+  double mean = docs.empty() ? 0 : double(ntoks) / docs.size();
+  cerr << docs.size() << " units of at most " << budget 
+       << " tokens from " << corpus.size() << " docs, " 
+       << mean << " tokens on average (" 
+       << 100 * mean / budget << "% fill), largest " << biggest
+       << ", " << nover << " sentences over the budget" << endl;
+  return Corpus(corpus.get_store(), docs);
+}
+
+// ******************************************************
+// Count word frequencies in a corpus
+// ******************************************************
+vector<unsigned> count_words(const Corpus& corpus, 
+			     unsigned vocabsize){
+  vector<unsigned> counts(vocabsize, 0);
+  for (auto& doc : corpus)
+    for (auto& sent : doc)
+      for (auto& w : sent)
+	counts[w] ++;
+  return counts;
+}
+
+// ******************************************************
+// Index class members and word positions from word2class
+// ******************************************************
+static void index_classes(WordClasses& wc, unsigned nclasses){
+  wc.members.assign(nclasses, vector<unsigned>());
+  wc.word2pos.assign(wc.word2class.size(), 0);
+  for (unsigned w = 0; w < wc.word2class.size(); w++){
+    auto& members = wc.members[wc.word2class[w]];
+    wc.word2pos[w] = members.size();
+    members.push_back(w);
+  }
+}
+
+// ******************************************************
+// Bin words into nclasses classes by frequency. Bins cover
+//   equal shares of the sqrt-frequency mass, so frequent 
+//   words get small classes and rare words large ones
+// ******************************************************
+WordClasses build_classes(const vector<unsigned>& counts, 
+			  unsigned nclasses){
+  WordClasses wc;
+  unsigned vocabsize = counts.size();
+  if (nclasses > vocabsize) nclasses = vocabsize;
+  vector<unsigned> ids(vocabsize);
+  for (unsigned w = 0; w < vocabsize; w++) ids[w] = w;
+  stable_sort(ids.begin(), ids.end(), [&](unsigned a, unsigned b){
+      return counts[a] > counts[b]; });
+  double total = 0, mass = 0;
+  for (auto& c : counts) total += sqrt((double)c);
+  wc.word2class.assign(vocabsize, 0);
+  unsigned c = 0;
+  for (auto& w : ids){
+    mass += sqrt((double)counts[w]);
+    wc.word2class[w] = c;
+    if ((mass > total * (c + 1) / nclasses) && (c + 1 < nclasses)) 
+      c ++;
+  }
+  // the last bin may have been left empty
+  index_classes(wc, wc.word2class[ids.back()] + 1);
+  return wc;
+}
+
+// ******************************************************
+// save word classes into a text file
+// ******************************************************
+int save_classes(string fname, const WordClasses& wc){
+  ofstream out(fname + ".classes");
+  out << wc.word2class.size() << " " << wc.size() << "\n";
+  for (auto& c : wc.word2class) out << c << "\n";
+  out.close();
+  return 0;
+}
+
+// ******************************************************
+// load word classes, return -1 if there is no class file
+// ******************************************************
+int load_classes(string fname, WordClasses& wc){
+  ifstream in(fname + ".classes");
+  if (!in.good()) return -1;
+  unsigned vocabsize, nclasses;
+  in >> vocabsize >> nclasses;
+  wc.word2class.assign(vocabsize, 0);
+  for (auto& c : wc.word2class) in >> c;
+  index_classes(wc, nclasses);
+  return 0;
+}
+
+// ******************************************************
+// save the rank of a low-rank output layer
+// ******************************************************
+int save_rank(string fname, unsigned rank){
+  ofstream out(fname + ".rank");
+  out << rank << endl;
+  out.close();
+  return 0;
+}
+
+// ******************************************************
+// load the rank of the output layer, 0 (full rank) if
+//   there is no rank file
+// ******************************************************
+unsigned load_rank(string fname){
+  ifstream in(fname + ".rank");
+  unsigned rank = 0;
+  if (in.good()) in >> rank;
+  return rank;
+}
+
+// ******************************************************
+// Prepare a trainer for updates on gradients summed over
+//   k documents. update(1.0/k) steps along their average;
+//   the trainer clips the summed gradient, so its 
+//   threshold grows by k to clip the average at the 
+//   original one, and the weight decay compounds the
+//   decay of k steps into one update.
+// ******************************************************
+void accumulate_updates(Trainer* trainer, unsigned k){
+  trainer->clip_threshold *= k;
+  trainer->lambda = 1 - pow(1 - trainer->lambda, k);
+}
+
+// ******************************************************
+// Draw words from a smoothed unigram distribution, 
+//   p(w) ~ count(w)^power
+// ******************************************************
+UnigramSampler::UnigramSampler(const vector<unsigned>& counts, 
+			       double power){
+  double total = 0;
+  for (auto& c : counts){
+    total += pow((double)c, power);
+    cdf.push_back(total);
+  }
+  for (auto& c : counts)
+    logq.push_back(log(pow((double)c, power) / total));
+  for (auto& p : cdf) p /= total;
+}
+
+unsigned UnigramSampler::sample() const {
+  double p = rand01();
+  unsigned w = upper_bound(cdf.begin(), cdf.end(), p) - cdf.begin();
+  return min(w, (unsigned)cdf.size() - 1);
+}
+
+// ******************************************************
+// Whether some lane finishes its k-th sentence at step t
+// ******************************************************
+bool DocBatch::ends(unsigned k, unsigned t) const {
+  for (auto& f : lasts[k][t])
+    if (f > 0) return true;
+  return false;
+}
+
+// ******************************************************
+// Build a minibatch from documents, padding with kpad
+// ******************************************************
+DocBatch make_batch(const vector<const Doc*>& docs, int kpad){
+  DocBatch batch;
+  unsigned nlanes = docs.size(), nsents = 0;
+  batch.nlanes = nlanes;
+  batch.ones.assign(nlanes, 1.0);
+  for (auto dp : docs)
+    if (dp->size() > nsents) nsents = dp->size();
+  batch.inputs.resize(nsents); batch.targets.resize(nsents);
+  batch.masks.resize(nsents); batch.lasts.resize(nsents);
+  batch.seq_targets.resize(nsents); batch.seq_masks.resize(nsents);
+  batch.keeps.assign(nsents, vector<float>(nlanes, 0.0));
+  for (unsigned k = 0; k < nsents; k++){
+    // the longest k-th sentence over all lanes
+    unsigned slen = 0;
+    for (auto dp : docs)
+      if ((k < dp->size()) && ((*dp)[k].size() - 1 > slen))
+	slen = (*dp)[k].size() - 1;
+    batch.inputs[k].assign(slen, vector<unsigned>(nlanes, kpad));
+    batch.targets[k].assign(slen, vector<unsigned>(nlanes, kpad));
+    batch.masks[k].assign(slen, vector<float>(nlanes, 0.0));
+    batch.lasts[k].assign(slen, vector<float>(nlanes, 0.0));
+    for (unsigned b = 0; b < nlanes; b++){
+      if (k >= docs[b]->size()){
+	batch.keeps[k][b] = 1.0;
+	continue;
       }
+      auto& sent = (*docs[b])[k];
+      for (unsigned t = 0; t < sent.size() - 1; t++){
+	batch.inputs[k][t][b] = sent[t];
+	batch.targets[k][t][b] = sent[t+1];
+	batch.masks[k][t][b] = 1.0;
+      }
+      batch.lasts[k][sent.size() - 2][b] = 1.0;
     }
-    if (tmpdoc.size() > 0){
-      newcorpus.push_back(tmpdoc);
-      tmpdoc.clear();
+    for (unsigned b = 0; b < nlanes; b++){
+      for (unsigned t = 0; t < slen; t++){
+	batch.seq_targets[k].push_back(batch.targets[k][t][b]);
+	batch.seq_masks[k].push_back(batch.masks[k][t][b]);
+      }
     }
   }
-  return newcorpus;
+  return batch;
+}
+
+// ******************************************************
+// Shuffle document indices block by block: whole blocks
+//   of neighbouring documents, then the documents within
+//   each block. block = 0 shuffles everything at once.
+// ******************************************************
+void shuffle_order(vector<unsigned>& order, unsigned block, 
+		   mt19937& rng){
+  if (block == 0){
+    shuffle(order.begin(), order.end(), rng);
+    return;
+  }
+  unsigned n = order.size(), nblocks = (n + block - 1) / block;
+  vector<unsigned> blocks(nblocks);
+  for (unsigned b = 0; b < nblocks; b++) blocks[b] = b;
+  shuffle(blocks.begin(), blocks.end(), rng);
+  order.clear();
+  for (auto b : blocks){
+    unsigned start = order.size();
+    for (unsigned i = b * block; (i < n) && (i < (b + 1) * block); i++)
+      order.push_back(i);
+    shuffle(order.begin() + start, order.end(), rng);
+  }
 }
@@ -16,7 +16,12 @@
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
+#include <random>
+#include <memory>
 #include <thread>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -29,37 +34,225 @@ using namespace cnn;
 // ********************************************************
 // Predefined information, used for the entire project
 // ********************************************************
-// Redefined types
-typedef vector<int> Sent;
-typedef vector<Sent> Doc;
-typedef vector<Doc> Corpus;
+// Redefined types. A corpus keeps all tokens in one 
+//   flat buffer; sentences and documents are views into
+//   it, so they are cheap to pass around and never own
+//   memory.
+class Sent {
+  const int *b, *e;
+public:
+  typedef const int* const_iterator;
+  Sent():b(nullptr), e(nullptr){}
+  Sent(const int* b, const int* e):b(b), e(e){}
+  size_t size() const { return e - b; }
+  bool empty() const { return b == e; }
+  const int& operator[](size_t i) const { return b[i]; }
+  const int& back() const { return *(e - 1); }
+  const int* begin() const { return b; }
+  const int* end() const { return e; }
+  // drop the last token from the view
+  void pop_back() { --e; }
+};
+
+class Doc {
+  const Sent *b, *e;
+public:
+  typedef const Sent* const_iterator;
+  Doc():b(nullptr), e(nullptr){}
+  Doc(const Sent* b, const Sent* e):b(b), e(e){}
+  size_t size() const { return e - b; }
+  bool empty() const { return b == e; }
+  const Sent& operator[](size_t i) const { return b[i]; }
+  const Sent& back() const { return *(e - 1); }
+  const Sent* begin() const { return b; }
+  const Sent* end() const { return e; }
+};
+
+// tokens and sentence views of a corpus, shared by all
+//   corpora cut from it (e.g. by segment_doc)
+struct CorpusStore {
+  vector<int> toks; // unless the tokens are mapped from a file
+  vector<Sent> sents;
+  void* map;
+  size_t maplen;
+  CorpusStore():map(nullptr), maplen(0){}
+  ~CorpusStore();
+};
+
+class Corpus {
+  shared_ptr<CorpusStore> store;
+  vector<Doc> docs;
+public:
+  typedef vector<Doc>::const_iterator const_iterator;
+  Corpus(){}
+  Corpus(shared_ptr<CorpusStore> store, vector<Doc> docs)
+    :store(store), docs(move(docs)){}
+  // sentences start at toks[sents[i]], documents at 
+  //   sentence docs[j], both with one extra end offset
+  Corpus(shared_ptr<CorpusStore> store, const int* toks, 
+	 const uint64_t* sents, uint64_t nsents,
+	 const uint64_t* docs, uint64_t ndocs);
+  size_t size() const { return docs.size(); }
+  bool empty() const { return docs.empty(); }
+  const Doc& operator[](size_t i) const { return docs[i]; }
+  const_iterator begin() const { return docs.begin(); }
+  const_iterator end() const { return docs.end(); }
+  const shared_ptr<CorpusStore>& get_store() const { return store; }
+};
+
+// *******************************************************
+// load model from fname.model, mapping a binary file 
+//   straight into the parameters (old text archives are 
+//   read too); type, if given, must match the saved one
+// *******************************************************
+int load_model(string fname, Model& model, 
+	       const string& type = "");
+
+// *******************************************************
+// Precision of the values in a model file. This is a 
+//   disk format only: 16-bit files take half the space
+//   and half the reading, int8 ones (with a scale per 
+//   row) about a quarter, but cnn computes in fp32, so 
+//   load_model widens their values into fp32 parameters
+//   and a loaded model takes the same memory whatever 
+//   its file precision.
+// *******************************************************
+enum Precision { FP32 = 0, FP16 = 1, BF16 = 2, INT8 = 3 };
+
+// precision by name (fp32, fp16, bf16 or int8), -1 if 
+//   unknown
+int parse_precision(const string& name);
+
+// precision of fname.model, -1 if there is none
+int model_precision(string fname);
+
+// *******************************************************
+// A matrix in int8 with a scale per row, multiplied with
+//   vectors quantized on the fly: integer dot products 
+//   with one float multiplication per row
+// *******************************************************
+class QuantizedMatrix {
+private:
+  unsigned nrows, ncols;
+  vector<int8_t> values; // row by row
+  vector<float> scales; // of each row
+  // the quantized vector, reused by every product (so a 
+  //   matrix is used by one thread at a time)
+  mutable vector<int8_t> qx;
+  mutable float sx;
+  // dot product kernel for this CPU, chosen by quantize
+  int32_t (*dot)(const int8_t*, const int8_t*, size_t);
+
+  void quantize_input(const float* x) const;
+
+public:
+  QuantizedMatrix():nrows(0), ncols(0), sx(0), dot(nullptr){}
+
+  // from the values of a rows x cols matrix of cnn 
+  //   (column by column)
+  void quantize(const float* m, unsigned rows, unsigned cols);
+  bool empty() const { return nrows == 0; }
+
+  // y = Mx, plus bias if given
+  void multiply(const float* x, float* y,
+		const float* bias = nullptr) const;
+  // row i of Mx only
+  float multiply_row(unsigned i, const float* x) const;
+};
+
+// *******************************************************
+// give the pages of n values back to the system once 
+//   they are no longer used: they read as zeros (or from
+//   their model file) if they are touched again
+// *******************************************************
+void release_values(float* v, size_t n);
 
 // *******************************************************
-// load model from a archive file
+// save model into fname.model as a binary file, type 
+//   names the kind of model (e.g. "output", "dam")
 // *******************************************************
-int load_model(string fname, Model& model);
+int save_model(string fname, Model& model, 
+	       const string& type = "", 
+	       Precision precision = FP32);
 
 // *******************************************************
-// save model from a archive file
+// rewrite the binary file fname.model in another 
+//   precision
 // *******************************************************
-int save_model(string fname, Model& model);
+int convert_model(string fname, Precision precision);
 
 // *******************************************************
-// save dict from a archive file
+// Read-only dict in a binary file, mapped into memory: 
+//   a string table and a minimal perfect hash of the 
+//   words, so a lookup is one probe and one compare, 
+//   without any allocation. Ids are those of the 
+//   cnn::Dict it was saved from.
+// *******************************************************
+class FastDict {
+  void* mem;
+  size_t bytes;
+  const uint32_t* seeds; // one per bucket
+  const uint32_t* slots; // word id of every slot
+  const uint64_t* offsets; // of the words in strings
+  const char* strings;
+  uint32_t nwords, nbuckets;
+  int unk;
+  uint64_t hash; // fingerprint of the words
+public:
+  FastDict();
+  ~FastDict();
+  FastDict(const FastDict&) = delete;
+  FastDict& operator=(const FastDict&) = delete;
+  // write the binary file of a dict
+  static int save(const string& fname, cnn::Dict& d);
+  // map a binary file, -1 if it is missing or broken
+  int open(const string& fname);
+  bool is_open() const { return mem != nullptr; }
+  unsigned size() const { return nwords; }
+  // the same as a hash of the words of the cnn::Dict it
+  //   was saved from, without reading them
+  uint64_t fingerprint() const { return hash; }
+  // id of a word, -1 if it is not in the dict
+  int lookup(const char* w, size_t n) const;
+  // id of a word, the id of UNK if it is not in the dict;
+  //   throws like a frozen cnn::Dict if there is no UNK
+  int convert(const char* w, size_t n) const {
+    int id = lookup(w, n);
+    if (id >= 0) return id;
+    if (unk < 0)
+      throw runtime_error("Unknown word encountered in frozen dictionary: "
+			  + string(w, n));
+    return unk;
+  }
+  string word(int id) const;
+  // add all words to a cnn::Dict, in id order
+  void fill(cnn::Dict& d) const;
+};
+
+// *******************************************************
+// save dict into an archive file (fname.dict) and into
+//   a binary file (fname.dict.bin)
 // *******************************************************
 int save_dict(string fname, cnn::Dict d);
 
 // *******************************************************
-// load dict from a archive file
+// load dict from its binary file, or from its archive 
+//   file for dicts saved before. With fast, the binary 
+//   file stays mapped there and d is left empty: 
+//   readers look words up in fast, and callers that
+//   need a cnn::Dict (e.g. to extend or save it) call
+//   fast->fill(d)
 // *******************************************************
-int load_dict(string fname, cnn::Dict& d);
+int load_dict(string fname, cnn::Dict& d, FastDict* fast = nullptr);
 
 // *******************************************************
 // read sentences and convect tokens to indices
 // *******************************************************
-Sent MyReadSentence(const std::string& line, 
-		    Dict* sd, 
-		    bool update);
+vector<int> MyReadSentence(const std::string& line, 
+			   Dict* sd, 
+			   bool update);
+vector<int> MyReadSentence(const std::string& line, 
+			   const FastDict& fd);
 
 // *****************************************************
 // 
@@ -67,11 +260,103 @@ Sent MyReadSentence(const std::string& line,
 Doc makeDoc();
 
 // *****************************************************
-// read training and dev data
+// read training and dev data, through a binary cache 
+//   (<filename>.bin) that is written on the first read;
+//   without update, words are looked up in fast if it 
+//   is given, which then stands for the dict (dptr may
+//   be empty, as load_dict leaves it)
 // *****************************************************
 Corpus readData(char* filename, 
 		cnn::Dict* dptr,
-		bool b_update = true);
+		bool b_update = true,
+		const FastDict* fast = nullptr);
+
+// *****************************************************
+// Compressed corpus archives (varint token ids, most 
+//   frequent words first, indexed blocks). readData 
+//   reads them like text files; load_archive decodes 
+//   only the count documents from first on, in parallel
+// *****************************************************
+bool is_archive(const char* filename);
+int save_archive(const string& fname, const Corpus& corpus, 
+		 cnn::Dict* dptr);
+Corpus load_archive(const char* filename, cnn::Dict* dptr, 
+		    bool b_update = true, uint64_t first = 0, 
+		    uint64_t count = UINT64_MAX,
+		    const FastDict* fast = nullptr);
+
+// *****************************************************
+// read training data and build the dict in a counting 
+//   pre-pass: <s>, </s> and UNK come first, then the 
+//   words from the most to the least frequent. Only 
+//   words seen at least min_count times, and only the 
+//   max_size most frequent ones (0 for no limit, the 
+//   three above included) get into the dict, all others
+//   are read as UNK
+// *****************************************************
+Corpus readTrainingData(char* filename, 
+			cnn::Dict* dptr,
+			unsigned min_count = 0,
+			unsigned max_size = 0);
+
+// *****************************************************
+// map every token of a corpus through idmap, into a 
+//   new flat store
+// *****************************************************
+Corpus remap_corpus(const Corpus& corpus, const vector<int>& idmap);
+
+// *****************************************************
+// parse a text corpus, without any cache
+// *****************************************************
+Corpus parseData(char* filename, 
+		 cnn::Dict* dptr,
+		 bool b_update = true,
+		 const FastDict* fast = nullptr);
+
+// *****************************************************
+// Read documents one at a time from a file, a FIFO or
+//   stdin ("-"), in the format of readData, against a 
+//   frozen dict (or its binary file, fast, if given): 
+//   unknown words are read as UNK. Each 
+//   document comes as a corpus of its own, so it is 
+//   freed as soon as nobody uses it.
+// *****************************************************
+class DocStream {
+  ifstream file;
+  istream* in;
+  cnn::Dict* dict;
+  const FastDict* fast;
+  size_t ndocs;
+public:
+  DocStream(const string& filename, cnn::Dict* dptr, 
+	    const FastDict* fast = nullptr);
+  bool good() const { return in->good(); }
+  // the next non-empty document, false at the end
+  bool next(Corpus& doc);
+  // documents read so far
+  size_t count() const { return ndocs; }
+};
+
+// *****************************************************
+// Documents for online training: the documents of a 
+//   stream in order (size = 0), or shuffled through a
+//   buffer of size documents: each draw takes a random
+//   slot and refills it from the stream, so every 
+//   document is drawn exactly once
+// *****************************************************
+class Reservoir {
+  DocStream& stream;
+  unsigned size;
+  mt19937 rng;
+  vector<Corpus> buffer;
+  bool ended; // the stream has no more documents
+public:
+  Reservoir(DocStream& stream, unsigned size, unsigned seed)
+    :stream(stream), size(size), rng(seed), ended(false){}
+  // the next document to train on, false at the end of
+  //   the stream
+  bool next(Corpus& doc);
+};
 
 
 // ******************************************************
@@ -88,6 +373,117 @@ int check_dir(string path);
 // ******************************************************
 // Segment a long document into several short ones
 // ******************************************************
-Corpus segment_doc(Corpus doc, int thresh);
+vector<Doc> segment_doc(const Doc& doc, int thresh);
+Corpus segment_doc(const Corpus& corpus, int thresh);
+
+// ******************************************************
+// Pack each document into units of at most budget tokens
+//   (cut at sentence boundaries, sizes balanced within 
+//   the document), and log how full the units are
+// ******************************************************
+vector<Doc> pack_doc(const Doc& doc, unsigned budget);
+Corpus pack_doc(const Corpus& corpus, unsigned budget);
+
+// ******************************************************
+// Count word frequencies in a corpus
+// ******************************************************
+vector<unsigned> count_words(const Corpus& corpus, 
+			     unsigned vocabsize);
+
+// ******************************************************
+// Word classes for a class-factored softmax
+// ******************************************************
+struct WordClasses {
+  vector<unsigned> word2class; // class of each word
+  vector<unsigned> word2pos; // position of each word in its class
+  vector<vector<unsigned>> members; // words of each class
+  unsigned size() const { return members.size(); }
+};
+
+// ******************************************************
+// Bin words into nclasses classes by frequency
+// ******************************************************
+WordClasses build_classes(const vector<unsigned>& counts, 
+			  unsigned nclasses);
+
+// ******************************************************
+// save word classes into a text file
+// ******************************************************
+int save_classes(string fname, const WordClasses& wc);
+
+// ******************************************************
+// load word classes, return -1 if there is no class file
+// ******************************************************
+int load_classes(string fname, WordClasses& wc);
+
+// ******************************************************
+// save the rank of a low-rank output layer
+// ******************************************************
+int save_rank(string fname, unsigned rank);
+
+// ******************************************************
+// load the rank of the output layer, 0 (full rank) if
+//   there is no rank file
+// ******************************************************
+unsigned load_rank(string fname);
+
+// ******************************************************
+// Prepare a trainer for updates on gradients summed over
+//   k documents: update(1.0/k) steps along their average,
+//   clipped at the original threshold, with the weight 
+//   decay of k steps
+// ******************************************************
+void accumulate_updates(Trainer* trainer, unsigned k);
+
+// ******************************************************
+// Draw words from a smoothed unigram distribution
+// ******************************************************
+struct UnigramSampler {
+  vector<double> cdf; // cumulative distribution
+  vector<float> logq; // log-probability of each word
+  UnigramSampler(){}
+  UnigramSampler(const vector<unsigned>& counts, double power = 0.75);
+  unsigned sample() const;
+};
+
+// ******************************************************
+// A minibatch of documents, one lane per document, laid 
+//   out sentence by sentence so that all lanes can run 
+//   through the same time step together
+// ******************************************************
+struct DocBatch {
+  unsigned nlanes;
+  // [k][t] word / target indices of every lane at step t 
+  //   of its k-th sentence (padded for short lanes)
+  vector<vector<vector<unsigned>>> inputs, targets;
+  // [k][t] 1 if the lane has a real token at this step
+  vector<vector<vector<float>>> masks;
+  // [k][t] 1 if this is the last step of the lane's sentence
+  vector<vector<vector<float>>> lasts;
+  // [k] 1 if the lane has no k-th sentence
+  vector<vector<float>> keeps;
+  // [k] targets and masks of the k-th sentences, lane 
+  //   after lane, for scoring a whole sentence at once
+  vector<vector<unsigned>> seq_targets;
+  vector<vector<float>> seq_masks;
+  // all ones, used to broadcast parameters over lanes
+  vector<float> ones;
+
+  // whether some lane finishes its k-th sentence at step t
+  bool ends(unsigned k, unsigned t) const;
+};
+
+// ******************************************************
+// Build a minibatch from documents, padding with kpad
+// ******************************************************
+DocBatch make_batch(const vector<const Doc*>& docs, int kpad);
+
+// ******************************************************
+// Shuffle document indices block by block, which keeps
+//   neighbouring documents together in an epoch. 
+//   block = 0 shuffles everything at once.
+// ******************************************************
+void shuffle_order(vector<unsigned>& order, unsigned block, 
+		   mt19937& rng);
 
 #endif